@@ -45,6 +45,7 @@
 #pragma once
 #include <stdlib.h>
 #include <vector>
+#include <memory_resource>
 
 namespace {
 
@@ -56,12 +57,14 @@ const size_t lineWidth = 72;
 class Ascii85Encoder
 {
 public:
-   std::vector<unsigned char> m_output;   // Storage for the encoded data.
+   std::pmr::vector<unsigned char> m_output;   // Storage for the encoded data.
    size_t m_column = 0;                   // Current column number in the output.
    size_t m_tuple = 0;                    // Temporary composite value.
    size_t m_count = 0;                    // Current position in tuple.
 
-   Ascii85Encoder() = default;
+   // The encoded data's storage comes from the given memory resource.
+   explicit Ascii85Encoder(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+      m_output(resource) { }
    Ascii85Encoder(const Ascii85Encoder &copy) = delete;
    ~Ascii85Encoder() = default;
 
@@ -69,9 +72,10 @@ public:
    // Encodes the given data into ASCII-85 format.
    // The encoded data is returned as a vector of bytes.
    //--------------------------------------------------------------------
-   const std::vector<unsigned char> & EncodeToAscii85(const void *data, size_t numBytes)
+   const std::pmr::vector<unsigned char> & EncodeToAscii85(const void *data, size_t numBytes)
    {
       m_output.clear();
+      m_output.reserve(numBytes / 4 * 5 + numBytes / 4 * 5 / lineWidth * 2 + 16);
       m_column = 0;
       m_tuple = 0;
       m_count = 0;
@@ -0,0 +1,165 @@
+//--------------------------------------------------------------------
+// bench.cpp
+// A small benchmark for the draw2pdf module.  When executed, this
+// program times how long it takes to write two million "x y l"
+// lineto operations into a content stream in each of the ways the
+// module has formatted them, and writes the results to the console:
+//    * The original Printf, which formatted into heap buffers
+//      (copied here, since the module's Printf has changed).
+//    * The current Printf, which formats into a stack buffer.
+//    * The stream's own number formatter (AddNumber/AddOperator).
+//    * PDFContentWriter's LineTo, which is what Draw2pdf's drawing
+//      functions use.
+//
+// (C) Copyright 2022 Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "draw2pdf.h"
+#include <chrono>
+#include <cstdarg>
+
+using namespace draw2pdf;
+
+namespace {
+
+const size_t numLines = 2000000;
+
+enum class Method
+{
+   OriginalPrintf,
+   Printf,
+   AddNumber,
+   ContentWriter
+};
+
+void OriginalPrintf(PDFStreamAccumulator &stream, const char *format, ...)
+{
+   // The content stream's Printf as it was originally written, which
+   // allocates two buffers for each call.
+
+   std::va_list args;
+   va_start(args, format);
+   std::string buffer;
+   for (size_t bufferSize = 32; bufferSize < 16384; bufferSize *= 2)
+   {
+      std::vector<char> tmp(bufferSize);
+      if (_vsnprintf_s(tmp.data(), bufferSize, _TRUNCATE, format, args) != -1)
+      {
+         buffer = tmp.data();
+         break;
+      }
+   }
+   va_end(args);
+   stream.AddData(buffer.c_str(), buffer.size());
+}
+
+double TimeLines(Method method, size_t &numBytes)
+{
+   // Write the lineto operations of a long zig-zag path into a
+   // content stream and return the number of seconds it took.
+
+   PDFStreamAccumulator stream;
+   PDFContentWriter content(stream);
+   const auto start = std::chrono::steady_clock::now();
+   for (size_t line = 0; line < numLines; line++)
+   {
+      const double x = static_cast<double>(line % 612) + 0.25;
+      const double y = static_cast<double>(line % 792) * 0.5;
+      switch (method)
+      {
+         case Method::OriginalPrintf:
+            OriginalPrintf(stream, "%lf %lf l\r\n", x, y);
+            break;
+         case Method::Printf:
+            stream.Printf("%lf %lf l\r\n", x, y);
+            break;
+         case Method::AddNumber:
+            stream.AddNumber(x);
+            stream.AddNumber(y);
+            stream.AddOperator("l");
+            break;
+         case Method::ContentWriter:
+            content.LineTo(x, y);
+            break;
+      }
+   }
+   const auto stop = std::chrono::steady_clock::now();
+
+   numBytes = stream.size();
+   return std::chrono::duration<double>(stop - start).count();
+}
+
+} // End anon namespace
+
+int main()
+{
+   try
+   {
+      const struct
+      {
+         Method         method;
+         const wchar_t *name;
+      } methods[] =
+      {
+         { Method::OriginalPrintf, L"original Printf" },
+         { Method::Printf,         L"current Printf" },
+         { Method::AddNumber,      L"AddNumber" },
+         { Method::ContentWriter,  L"PDFContentWriter" },
+      };
+
+      double originalSeconds = 0.;
+      for (const auto &method : methods)
+      {
+         size_t numBytes = 0;
+         const double seconds = TimeLines(method.method, numBytes);
+         if (method.method == Method::OriginalPrintf)
+            originalSeconds = seconds;
+         wprintf(L"%zu lines with %-18s %.3lf seconds, %zu bytes, %.1lfx original speed\n",
+            numLines, method.name, seconds, numBytes, seconds > 0. ? originalSeconds / seconds : 0.);
+      }
+   }
+   catch(const PDFException &exc)
+   {
+      wprintf(L"Exception:  %s(%zu):  %s\n",
+         exc.m_srcFile.c_str(), exc.m_srcLine, exc.m_errorMessage.c_str());
+      return EXIT_FAILURE;
+   }
+   catch(...)
+   {
+      wprintf(L"Aborted by unhandled exception!\n");
+      return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
@@ -39,6 +39,10 @@
 //    * PDF file format don't recognize exponential notation, so "%lf"
 //      is preferred to "%lg" when writing floating-point numbers
 //      with printf style formatters.
+//
+//    * Numbers in the page content streams are written with
+//      FormatNumber instead of printf, since printf is slow and its
+//      decimal point character depends on the C runtime's locale.
 //--------------------------------------------------------------------
 
 #include "draw2pdf.h"
@@ -47,41 +51,420 @@
 #include <time.h>
 #include <algorithm>
 #include <cstdarg>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#define NOUSER
+#include <windows.h>
+#include <io.h>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// The PNG predictor filters use SSE2 where it's available, which is
+// always the case on x64.
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PDF_USE_SSE2
+#endif
 
 namespace {
 
+// Size of the buffer that compressed stream data is produced in.
+const size_t compressBufferSize = 64 * 1024;
+
+// Powers of ten for scaling numbers by their decimal places.
+const double powersOfTen[] =
+{
+   1., 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+//---------------------------------------------------------------
+// Formats an unsigned integer as decimal text into the given
+// buffer, padded with leading zeros to at least minDigits digits.
+// The buffer must have room for at least 20 characters.
+// Returns the number of characters written.
+//---------------------------------------------------------------
+size_t FormatUnsigned(char *buffer, unsigned long long value, size_t minDigits = 1)
+{
+   char digits[24];
+   size_t count = 0;
+   do
+   {
+      digits[count++] = static_cast<char>('0' + value % 10);
+      value /= 10;
+   } while (value != 0 || count < minDigits);
+
+   for (size_t index = 0; index < count; ++index)
+      buffer[index] = digits[count - 1 - index];
+   return count;
+}
+
+//---------------------------------------------------------------
+// Formats a signed integer as decimal text into the given buffer.
+// The buffer must have room for at least 21 characters.
+// Returns the number of characters written.
+//---------------------------------------------------------------
+size_t FormatSigned(char *buffer, long long value)
+{
+   if (value < 0)
+   {
+      buffer[0] = '-';
+      return 1 + FormatUnsigned(buffer + 1, 0ULL - static_cast<unsigned long long>(value));
+   }
+   return FormatUnsigned(buffer, static_cast<unsigned long long>(value));
+}
+
+//---------------------------------------------------------------
+// Formats a floating-point number as fixed-point decimal text
+// (never exponential notation) into the given buffer, rounded to
+// the given number of decimal places (0 to 9).  Trailing zeros
+// are trimmed, so 0.5 is written as "0.5" and 3.0 as "3".  Always
+// uses '.' as the decimal point regardless of the C runtime's
+// locale.
+// The buffer must have room for at least 32 characters.
+// Returns the number of characters written.
+//---------------------------------------------------------------
+size_t FormatNumber(char *buffer, double value, int decimals)
+{
+   if (!std::isfinite(value))
+      value = 0.;
+
+   // Scale the number to an integer count of the smallest decimal
+   // place.  Numbers too large for that are written with fewer
+   // decimal places (such numbers are far outside of any sensible
+   // page size anyway).
+   double scaled = std::fabs(value) * powersOfTen[decimals];
+   while (scaled >= 9e18 && decimals > 0)
+      scaled = std::fabs(value) * powersOfTen[--decimals];
+   if (scaled >= 9e18)
+      scaled = 9e18;
+   const unsigned long long units = static_cast<unsigned long long>(scaled + 0.5);
+
+   size_t length = 0;
+   if (value < 0. && units != 0)
+      buffer[length++] = '-';
+
+   const unsigned long long divisor = static_cast<unsigned long long>(powersOfTen[decimals]);
+   length += FormatUnsigned(buffer + length, units / divisor);
+   unsigned long long fraction = units % divisor;
+   if (fraction != 0)
+   {
+      while (fraction % 10 == 0)
+      {
+         fraction /= 10;
+         --decimals;
+      }
+      buffer[length++] = '.';
+      length += FormatUnsigned(buffer + length, fraction, static_cast<size_t>(decimals));
+   }
+   return length;
+}
+
 //---------------------------------------------------------------
-// Compresses the given data with ZLIB's deflate compression.
-// The compressed data is returned.  No data is returned if
-// ZLIB is unable to compress the given data.
+// Returns true if the two numbers are written the same (or close
+// enough that the difference doesn't matter) at the given number
+// of decimal places.
 //---------------------------------------------------------------
-std::vector<unsigned char> DeflateData(const void *data, size_t numBytes)
+bool SameNumber(double a, double b, int decimals)
 {
-   uLongf numCompressedBytes = static_cast<uLongf>(numBytes + 8192);
-   std::vector<unsigned char> output(numCompressedBytes);
+   return fabs(a - b) < 0.5 / powersOfTen[decimals];
+}
 
-   int errcode = compress(output.data(), &numCompressedBytes,
-                          reinterpret_cast<const Bytef *>(data),
-                          static_cast<uLong>(numBytes));
-   if (errcode != Z_OK)
-      numCompressedBytes = 0;
+//---------------------------------------------------------------
+// Returns the number rounded to the given number of decimal
+// places, the same as it's written by FormatNumber.
+//---------------------------------------------------------------
+double RoundNumber(double value, int decimals)
+{
+   return std::round(value * powersOfTen[decimals]) / powersOfTen[decimals];
+}
 
-   output.resize(numCompressedBytes);
+//---------------------------------------------------------------
+// Returns true if the two colors are the same when written at the
+// given number of decimal places.
+//---------------------------------------------------------------
+bool SameColor(const draw2pdf::PDFColor &a, const draw2pdf::PDFColor &b, int decimals)
+{
+   return SameNumber(a.m_red, b.m_red, decimals) &&
+          SameNumber(a.m_green, b.m_green, decimals) &&
+          SameNumber(a.m_blue, b.m_blue, decimals);
+}
 
-   return output;
+//---------------------------------------------------------------
+// Returns true if the color is a shade of gray (red, green, and
+// blue are the same) at the given number of decimal places.
+//---------------------------------------------------------------
+bool IsGray(const draw2pdf::PDFColor &color, int decimals)
+{
+   return SameNumber(color.m_red, color.m_green, decimals) &&
+          SameNumber(color.m_red, color.m_blue, decimals);
 }
 
 //--------------------------------------------------------------------
-// Convert a wide string to a narrow string by simple casting.
+// Converts a wide string to a narrow string for a PDF string literal,
+// by simple casting.  The characters that have special meanings in
+// PDF string literals (parentheses and backslash) are escaped with
+// backslashes.  Done in a single branchless pass into a reused
+// output buffer.  Each character has to be narrowed anyway, and
+// the escaping depends on the narrowed character, so scanning the
+// wide string for runs that need no escaping only adds a pass.
 // Note this is only compatible with 8-bit US/ANSI characters.
 // Does not work with wide/Unicode characters.
 //--------------------------------------------------------------------
-std::string WideToNarrow(const std::wstring &w)
+void EscapeText(const std::wstring &w, std::pmr::string &n)
 {
-   std::string n;
+   // Size the output for the worst case (every character escaped),
+   // then trim it to the actual length.
+   n.resize(w.size() * 2);
+   char *out = &n[0];
    for (const auto chr : w)
-      n += static_cast<char>(chr);
-   return n;
+   {
+      const char c = static_cast<char>(chr);
+      *out = '\\';
+      out += (c == '(' || c == ')' || c == '\\');
+      *out++ = c;
+   }
+   n.resize(static_cast<size_t>(out - n.data()));
+}
+
+//---------------------------------------------------------------
+// Memory allocation functions for ZLIB, which get their memory
+// from the std::pmr::memory_resource given as ZLIB's opaque
+// pointer.  ZLIB doesn't give the size of the memory when it
+// frees it, so the size is stored in front of the memory.
+//---------------------------------------------------------------
+voidpf ZlibAllocate(voidpf opaque, uInt items, uInt size)
+{
+   const size_t numBytes = sizeof(std::max_align_t) + static_cast<size_t>(items) * size;
+   try
+   {
+      unsigned char *memory = static_cast<unsigned char *>(
+         static_cast<std::pmr::memory_resource *>(opaque)->allocate(numBytes));
+      *reinterpret_cast<size_t *>(memory) = numBytes;
+      return memory + sizeof(std::max_align_t);
+   }
+   catch (...)
+   {
+      return Z_NULL;
+   }
+}
+
+void ZlibFree(voidpf opaque, voidpf address)
+{
+   unsigned char *memory = static_cast<unsigned char *>(address) - sizeof(std::max_align_t);
+   static_cast<std::pmr::memory_resource *>(opaque)->deallocate(memory, *reinterpret_cast<size_t *>(memory));
+}
+
+//---------------------------------------------------------------
+// Returns the Adler-32 checksum of two pieces of data put
+// together, given the checksum of each piece and the length of the
+// second piece.  (ZLIB 1.1.4 doesn't have adler32_combine.)
+//---------------------------------------------------------------
+uLong CombineAdler32(uLong adler1, uLong adler2, size_t length2)
+{
+   const uLong base = 65521;
+   const uLong remainder = static_cast<uLong>(length2 % base);
+   uLong sum1 = adler1 & 0xFFFF;
+   uLong sum2 = (remainder * sum1) % base;
+   sum1 += (adler2 & 0xFFFF) + base - 1;
+   sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + base - remainder;
+   if (sum1 >= base)
+      sum1 -= base;
+   if (sum1 >= base)
+      sum1 -= base;
+   if (sum2 >= 2 * base)
+      sum2 -= 2 * base;
+   if (sum2 >= base)
+      sum2 -= base;
+   return sum1 | (sum2 << 16);
+}
+
+//---------------------------------------------------------------
+// Initializes a ZLIB stream for compressing with the given
+// settings, clamped to the ranges ZLIB accepts.  Returns ZLIB's
+// error code.
+//---------------------------------------------------------------
+int InitDeflate(z_stream &stream, const draw2pdf::PDFCompressionSettings &settings)
+{
+   int strategy = Z_DEFAULT_STRATEGY;
+   if (settings.m_strategy == draw2pdf::PDFCompressionStrategy::Filtered)
+      strategy = Z_FILTERED;
+   else if (settings.m_strategy == draw2pdf::PDFCompressionStrategy::HuffmanOnly)
+      strategy = Z_HUFFMAN_ONLY;
+   const int level = (settings.m_level < 0 ? Z_DEFAULT_COMPRESSION : std::min(settings.m_level, 9));
+   return deflateInit2(&stream, level, Z_DEFLATED,
+                       std::clamp(settings.m_windowBits, 9, MAX_WBITS),
+                       std::clamp(settings.m_memLevel, 1, MAX_MEM_LEVEL), strategy);
+}
+
+//---------------------------------------------------------------
+// Returns true if the given settings compress the same way, i.e.
+// everything but the minimum size is the same.
+//---------------------------------------------------------------
+bool SameDeflateSettings(const draw2pdf::PDFCompressionSettings &a, const draw2pdf::PDFCompressionSettings &b)
+{
+   return a.m_level == b.m_level && a.m_windowBits == b.m_windowBits &&
+          a.m_memLevel == b.m_memLevel && a.m_strategy == b.m_strategy;
+}
+
+//---------------------------------------------------------------
+// PNG filter types, one of which starts each scanline of image
+// data that's filtered for PNG predictor 15.
+//---------------------------------------------------------------
+enum PngFilter
+{
+   PngNone = 0,
+   PngSub = 1,
+   PngUp = 2,
+   PngAverage = 3,
+   PngPaeth = 4
+};
+
+//---------------------------------------------------------------
+// Returns the value that the given PNG filter predicts for a byte
+// from the corresponding bytes of the pixel to its left (a), the
+// pixel above (b) and the pixel above and to the left (c).
+//---------------------------------------------------------------
+template <int filter>
+inline int PngPredict(int a, int b, int c)
+{
+   if constexpr (filter == PngSub)
+      return a;
+   else if constexpr (filter == PngUp)
+      return b;
+   else if constexpr (filter == PngAverage)
+      return (a + b) >> 1;
+   else if constexpr (filter == PngPaeth)
+   {
+      const int pa = abs(b - c);
+      const int pb = abs(a - c);
+      const int pc = abs(a + b - 2 * c);
+      if (pa <= pb && pa <= pc)
+         return a;
+      return (pb <= pc ? b : c);
+   }
+   else
+      return 0;
+}
+
+#ifdef PDF_USE_SSE2
+//---------------------------------------------------------------
+// Adds the magnitudes of 16 filtered bytes, taken as signed, to
+// the two 64-bit sums.
+//---------------------------------------------------------------
+inline __m128i AddMagnitudes(__m128i sums, __m128i bytes)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i magnitudes = _mm_min_epu8(bytes, _mm_sub_epi8(zero, bytes));
+   return _mm_add_epi64(sums, _mm_sad_epu8(magnitudes, zero));
+}
+
+//---------------------------------------------------------------
+// Returns the absolute values of eight 16-bit integers.
+//---------------------------------------------------------------
+inline __m128i Abs16(__m128i values)
+{
+   return _mm_max_epi16(values, _mm_sub_epi16(_mm_setzero_si128(), values));
+}
+
+//---------------------------------------------------------------
+// Returns the Paeth predictions for eight bytes widened to 16
+// bits, given the left (a), above (b) and above-left (c) bytes.
+//---------------------------------------------------------------
+inline __m128i PaethPredict16(__m128i a, __m128i b, __m128i c)
+{
+   const __m128i pa = Abs16(_mm_sub_epi16(b, c));
+   const __m128i pb = Abs16(_mm_sub_epi16(a, c));
+   const __m128i pc = Abs16(_mm_add_epi16(_mm_sub_epi16(a, c), _mm_sub_epi16(b, c)));
+   const __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   const __m128i useC = _mm_cmpgt_epi16(pb, pc);
+   const __m128i bOrC = _mm_or_si128(_mm_and_si128(useC, c), _mm_andnot_si128(useC, b));
+   return _mm_or_si128(_mm_and_si128(notA, bOrC), _mm_andnot_si128(notA, a));
+}
+#endif
+
+//---------------------------------------------------------------
+// Filters one scanline of image data with the given PNG filter,
+// given the previous scanline (all zeros for the first), and
+// returns the sum of the magnitudes of the filtered bytes, taken
+// as signed.  The smallest sum usually compresses best.
+//---------------------------------------------------------------
+template <int filter>
+size_t PngFilterScanline(
+   const unsigned char *row,     // Scanline to be filtered.
+   const unsigned char *prev,    // Previous scanline.
+   size_t numBytes,              // Number of bytes in a scanline.
+   size_t bytesPerPixel,         // Number of bytes in a pixel.
+   unsigned char *out            // Receives the filtered scanline.
+   )
+{
+   size_t sum = 0;
+   size_t i = 0;
+
+   // The first pixel has nothing to its left.
+   for (; i < bytesPerPixel && i < numBytes; ++i)
+   {
+      out[i] = static_cast<unsigned char>(row[i] - PngPredict<filter>(0, prev[i], 0));
+      sum += (out[i] < 128 ? out[i] : 256 - out[i]);
+   }
+
+#ifdef PDF_USE_SSE2
+   // Each filtered byte depends only on the unfiltered data, so 16
+   // bytes can be filtered at a time.
+   const __m128i zero = _mm_setzero_si128();
+   __m128i sums = zero;
+   for (; i + 16 <= numBytes; i += 16)
+   {
+      __m128i predicted = zero;
+      if constexpr (filter == PngSub)
+      {
+         predicted = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i - bytesPerPixel));
+      }
+      else if constexpr (filter == PngUp)
+      {
+         predicted = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+      }
+      else if constexpr (filter == PngAverage)
+      {
+         // _mm_avg_epu8 rounds up, so take off the odd bit.
+         const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i - bytesPerPixel));
+         const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+         const __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+         predicted = _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+      }
+      else if constexpr (filter == PngPaeth)
+      {
+         const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i - bytesPerPixel));
+         const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i));
+         const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prev + i - bytesPerPixel));
+         const __m128i low = PaethPredict16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                                            _mm_unpacklo_epi8(c, zero));
+         const __m128i high = PaethPredict16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                                             _mm_unpackhi_epi8(c, zero));
+         predicted = _mm_packus_epi16(low, high);
+      }
+      const __m128i filtered = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i)), predicted);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), filtered);
+      sums = AddMagnitudes(sums, filtered);
+   }
+   uint64_t lanes[2];
+   _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), sums);
+   sum += static_cast<size_t>(lanes[0] + lanes[1]);
+#endif
+
+   for (; i < numBytes; ++i)
+   {
+      out[i] = static_cast<unsigned char>(
+         row[i] - PngPredict<filter>(row[i - bytesPerPixel], prev[i], prev[i - bytesPerPixel]));
+      sum += (out[i] < 128 ? out[i] : 256 - out[i]);
+   }
+   return sum;
 }
 
 } // End anon namespace
@@ -89,141 +472,1761 @@ std::string WideToNarrow(const std::wstring &w)
 namespace draw2pdf {
 
 //---------------------------------------------------------------
-// Adds the given bytes of binary data to the stream.
+// The ZLIB stream used by a PDFDeflater, and the buffer that the
+// compressed data is produced in.
 //---------------------------------------------------------------
-void PDFStreamAccumulator::AddData(const void *data, size_t numBytes)
+struct PDFDeflater::ZlibStream
 {
-   const unsigned char *ucdata = reinterpret_cast<const unsigned char *>(data);
-   m_data.insert(m_data.end(), ucdata, ucdata + numBytes);
-}
+   z_stream m_stream;
+   unsigned char m_buffer[compressBufferSize];
+};
 
 //---------------------------------------------------------------
-// Adds formatted text to the stream.
-// Formatting is the same as printf in the runtime library.
+// The worker threads of a PDFDeflater that compresses in parallel,
+// and a ring of blocks of data for them to compress.  Each block is
+// compressed as a separate ZLIB stream with the previous block's
+// last 32KB as its preset dictionary, flushed to a byte boundary
+// (except the last block).  With the ZLIB header and dictionary ID
+// taken off the front of all but the first block, and the checksum
+// off the end of the last block, the pieces join together into one
+// stream of deflate data.  ZLIB 1.1.4 can't set a dictionary for a
+// raw deflate stream, so the headers are trimmed off instead.
+//
+// All of the memory is allocated up front by the thread using the
+// deflater, so the worker threads never use the memory resource.
 //---------------------------------------------------------------
-void PDFStreamAccumulator::Printf(const char *format, ...)
+struct PDFDeflater::Parallel
 {
-   std::va_list args;
-   va_start(args, format);
-   std::string buffer;
-   for (size_t bufferSize = 32; bufferSize < 16384; bufferSize *= 2)
+   static constexpr size_t dictionarySize = 32 * 1024;
+   static constexpr size_t outputSize = parallelBlockSize + parallelBlockSize / 8 + 64;
+
+   enum class State { Free, Filling, Queued, Working, Done };
+
+   struct Block
+   {
+      unsigned char *   m_input = nullptr;   // Dictionary, then the data.
+      size_t            m_dictionaryBytes = 0;
+      size_t            m_inputBytes = 0;
+      unsigned char *   m_output = nullptr;
+      size_t            m_outputBytes = 0;
+      uLong             m_adler = 0;         // Checksum of the data.
+      bool              m_first = false;
+      bool              m_last = false;
+      bool              m_failed = false;
+      State             m_state = State::Free;
+   };
+
+   explicit Parallel(std::pmr::memory_resource *resource) :
+      m_resource(resource), m_blocks(resource), m_streams(resource), m_threads(resource) { }
+
+   void Start(size_t numThreads, const PDFCompressionSettings &settings);
+   void Stop() noexcept;
+   void RunWorker(size_t index);
+   static bool Compress(z_stream &stream, Block &block);
+
+   std::pmr::memory_resource *   m_resource;
+   std::pmr::vector<Block>       m_blocks;
+   std::pmr::vector<z_stream>    m_streams;     // One per worker thread.
+   std::pmr::vector<std::thread> m_threads;
+   size_t                        m_numThreads = 0;
+   PDFCompressionSettings        m_settings;
+
+   std::mutex                    m_mutex;
+   std::condition_variable       m_queued;      // Signaled when a block is queued.
+   std::condition_variable       m_done;        // Signaled when a block is done.
+   bool                          m_stopping = false;
+
+   // Used only by the thread using the deflater:  the block being
+   // filled, the oldest block whose output hasn't been collected,
+   // whether any block of the current stream has been queued, and
+   // the checksum of the data collected so far.
+   size_t                        m_fill = 0;
+   size_t                        m_collect = 0;
+   bool                          m_submitted = false;
+   uLong                         m_adler = 0;
+};
+
+//---------------------------------------------------------------
+// Allocates the blocks and ZLIB streams and starts the worker
+// threads.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::Parallel::Start(size_t numThreads, const PDFCompressionSettings &settings)
+{
+   m_numThreads = numThreads;
+   m_settings = settings;
+   try
    {
-      std::vector<char> tmp(bufferSize);
-      if (_vsnprintf_s(tmp.data(), bufferSize, _TRUNCATE, format, args) != -1)
+      // Two blocks per thread keeps the workers busy while the
+      // next blocks are being filled and collected.
+      m_blocks.resize(2 * numThreads);
+      for (Block &block : m_blocks)
       {
-         buffer = tmp.data();
-         break;
+         block.m_input = static_cast<unsigned char *>(m_resource->allocate(dictionarySize + parallelBlockSize, 1));
+         block.m_output = static_cast<unsigned char *>(m_resource->allocate(outputSize, 1));
       }
+
+      // The streams must not move once initialized.
+      m_streams.reserve(numThreads);
+      for (size_t index = 0; index < numThreads; ++index)
+      {
+         z_stream stream;
+         memset(&stream, 0, sizeof(stream));
+         stream.zalloc = ZlibAllocate;
+         stream.zfree = ZlibFree;
+         stream.opaque = m_resource;
+         m_streams.push_back(stream);
+         if (InitDeflate(m_streams.back(), settings) != Z_OK)
+         {
+            m_streams.pop_back();
+            throw PDFException(__FILEW__, __LINE__, L"Failed initializing ZLIB compression.");
+         }
+      }
+
+      m_threads.reserve(numThreads);
+      for (size_t index = 0; index < numThreads; ++index)
+         m_threads.emplace_back(&Parallel::RunWorker, this, index);
+   }
+   catch (const std::system_error &)
+   {
+      Stop();
+      throw PDFException(__FILEW__, __LINE__, L"Failed starting compression threads.");
+   }
+   catch (...)
+   {
+      Stop();
+      throw;
    }
-   va_end(args);
-   AddData(buffer.c_str(), buffer.size());
 }
 
 //---------------------------------------------------------------
-Draw2pdf::~Draw2pdf()
+// Stops the worker threads and frees the memory.
+//---------------------------------------------------------------
+void PDFDeflater::Parallel::Stop() noexcept
 {
-   Close();
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_queued.notify_all();
+   for (std::thread &thread : m_threads)
+      thread.join();
+   m_threads.clear();
+
+   for (z_stream &stream : m_streams)
+      deflateEnd(&stream);
+   m_streams.clear();
+   for (Block &block : m_blocks)
+   {
+      if (block.m_input != nullptr)
+         m_resource->deallocate(block.m_input, dictionarySize + parallelBlockSize, 1);
+      if (block.m_output != nullptr)
+         m_resource->deallocate(block.m_output, outputSize, 1);
+   }
+   m_blocks.clear();
 }
 
 //---------------------------------------------------------------
-// Opens a new PDF file for writing.  Errors throw.
-// The dimensions of the page(s) in the PDF file should be given
-// in units of typesetting points (1 point = 1/72 inch).
+// Worker thread, which compresses queued blocks, oldest first,
+// until the deflater is stopped.
 //---------------------------------------------------------------
-void Draw2pdf::Open(const std::wstring &filename,
-         const PDFPoint &pageMinimumPoints,
-         const PDFPoint &pageMaximumPoints)
+void PDFDeflater::Parallel::RunWorker(size_t index)
 {
-   Close();
-   m_pageMinimumPoints = pageMinimumPoints;
-   m_pageMaximumPoints = pageMaximumPoints;
+   std::unique_lock<std::mutex> lock(m_mutex);
+   for (;;)
+   {
+      Block *block = nullptr;
+      m_queued.wait(lock, [this, &block]
+      {
+         for (size_t count = 0; count < m_blocks.size() && block == nullptr; ++count)
+         {
+            Block &candidate = m_blocks[(m_collect + count) % m_blocks.size()];
+            if (candidate.m_state == State::Queued)
+               block = &candidate;
+         }
+         return m_stopping || block != nullptr;
+      });
+      if (m_stopping)
+         return;
+
+      block->m_state = State::Working;
+      lock.unlock();
+      bool ok = Compress(m_streams[index], *block);
+      lock.lock();
+      block->m_failed = !ok;
+      block->m_state = State::Done;
+      m_done.notify_all();
+   }
+}
 
-   if (_wfopen_s(&m_file, filename.c_str(), L"wb") || m_file == nullptr)
-      throw PDFException(__FILEW__, __LINE__,
-               std::wstring(L"Failed opening file for writing:  ") + filename);
+//---------------------------------------------------------------
+// Compresses one block with the given ZLIB stream.  Returns false
+// if ZLIB fails.
+//---------------------------------------------------------------
+bool PDFDeflater::Parallel::Compress(z_stream &stream, Block &block)
+{
+   if (deflateReset(&stream) != Z_OK)
+      return false;
+   if (block.m_dictionaryBytes > 0 &&
+       deflateSetDictionary(&stream, block.m_input, static_cast<uInt>(block.m_dictionaryBytes)) != Z_OK)
+      return false;
+
+   stream.next_in = block.m_input + block.m_dictionaryBytes;
+   stream.avail_in = static_cast<uInt>(block.m_inputBytes);
+   stream.next_out = block.m_output;
+   stream.avail_out = static_cast<uInt>(outputSize);
+   int errcode = deflate(&stream, block.m_last ? Z_FINISH : Z_SYNC_FLUSH);
+   if (block.m_last ? errcode != Z_STREAM_END
+                    : errcode != Z_OK || stream.avail_in != 0 || stream.avail_out == 0)
+      return false;
+   block.m_outputBytes = outputSize - stream.avail_out;
+   block.m_adler = adler32(adler32(0L, Z_NULL, 0), block.m_input + block.m_dictionaryBytes,
+                           static_cast<uInt>(block.m_inputBytes));
+   return true;
+}
 
-   // Write the PDF file signature to the beginning of the file.
-   fprintf(m_file, "%%PDF-1.4\r\n");
-   fprintf(m_file, "%%\xC0\xE1\xD2\xC3\xB4\r\n");
-   fprintf(m_file, "%%PDF file generated by draw2pdf.lib\r\n");
+PDFDeflater::~PDFDeflater()
+{
+   DoStopParallel();
+   if (m_zlib != nullptr)
+   {
+      deflateEnd(&m_zlib->m_stream);
+      m_resource->deallocate(m_zlib, sizeof(ZlibStream), alignof(ZlibStream));
+   }
+}
 
-   // Write the first object in the PDF file, the catalog object.
-   m_catalogObjNumber = m_objNumber++;
-   m_pagesObjNumber = m_objNumber++;
-   fprintf(m_file, "\r\n");
-   m_crossRefs.push_back(PDFCrossRef(m_catalogObjNumber, static_cast<size_t>(ftell(m_file))));
-   fprintf(m_file, "%zu 0 obj\r\n", m_catalogObjNumber);
-   fprintf(m_file, "<<\r\n");
-   fprintf(m_file, "/Type /Catalog\r\n");
-   fprintf(m_file, "/Pages %zu 0 R\r\n", m_pagesObjNumber);
-   fprintf(m_file, ">>\r\n");
-   fprintf(m_file, "endobj\r\n");
+//---------------------------------------------------------------
+// Starts a new stream of compressed data, which is added to the
+// given stream accumulator.  The ZLIB stream is created the first
+// time, and reset after that.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::Begin(PDFStreamAccumulator &output)
+{
+   // Start over with a new ZLIB stream if the settings changed.
+   if (m_zlib != nullptr && !SameDeflateSettings(m_settings, m_zlibSettings))
+   {
+      deflateEnd(&m_zlib->m_stream);
+      m_resource->deallocate(m_zlib, sizeof(ZlibStream), alignof(ZlibStream));
+      m_zlib = nullptr;
+   }
 
-   DoBeginPage();
+   if (m_zlib == nullptr)
+   {
+      // ZLIB's own memory comes from the memory resource too.
+      ZlibStream *zlib = static_cast<ZlibStream *>(m_resource->allocate(sizeof(ZlibStream), alignof(ZlibStream)));
+      memset(&zlib->m_stream, 0, sizeof(zlib->m_stream));
+      zlib->m_stream.zalloc = ZlibAllocate;
+      zlib->m_stream.zfree = ZlibFree;
+      zlib->m_stream.opaque = m_resource;
+      if (InitDeflate(zlib->m_stream, m_settings) != Z_OK)
+      {
+         m_resource->deallocate(zlib, sizeof(ZlibStream), alignof(ZlibStream));
+         throw PDFException(__FILEW__, __LINE__, L"Failed initializing ZLIB compression.");
+      }
+      m_zlib = zlib;
+      m_zlibSettings = m_settings;
+   }
+   else if (deflateReset(&m_zlib->m_stream) != Z_OK)
+   {
+      throw PDFException(__FILEW__, __LINE__, L"Failed initializing ZLIB compression.");
+   }
+
+   // Start, restart or stop the worker threads if the number of
+   // threads or the settings were changed.
+   size_t numThreads = m_numThreads;
+   if (numThreads == 0)
+      numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+   if (m_parallel != nullptr && (m_parallel->m_numThreads != numThreads ||
+                                 !SameDeflateSettings(m_parallel->m_settings, m_settings)))
+      DoStopParallel();
+   if (m_parallel == nullptr && numThreads > 1)
+   {
+      Parallel *parallel = static_cast<Parallel *>(m_resource->allocate(sizeof(Parallel), alignof(Parallel)));
+      new (parallel) Parallel(m_resource);
+      m_parallel = parallel;
+      try
+      {
+         m_parallel->Start(numThreads, m_settings);
+      }
+      catch (...)
+      {
+         DoStopParallel();
+         throw;
+      }
+   }
+   m_inputBytes = 0;
+   m_seconds = 0.;
+
+   if (m_parallel != nullptr)
+   {
+      // Wait for any blocks left over from a stream that failed.
+      Parallel &p = *m_parallel;
+      std::unique_lock<std::mutex> lock(p.m_mutex);
+      p.m_done.wait(lock, [&p]
+      {
+         for (const Parallel::Block &block : p.m_blocks)
+         {
+            if (block.m_state == Parallel::State::Queued || block.m_state == Parallel::State::Working)
+               return false;
+         }
+         return true;
+      });
+      for (Parallel::Block &block : p.m_blocks)
+         block.m_state = Parallel::State::Free;
+
+      p.m_fill = p.m_collect = 0;
+      p.m_submitted = false;
+      Parallel::Block &first = p.m_blocks[0];
+      first.m_state = Parallel::State::Filling;
+      first.m_dictionaryBytes = first.m_inputBytes = 0;
+      first.m_first = true;
+      first.m_last = false;
+   }
+   m_output = &output;
 }
 
 //---------------------------------------------------------------
-// Finishes writing the currently open PDF file.  Errors throw.
+// Stops the worker threads, if any.
 //---------------------------------------------------------------
-void Draw2pdf::Close()
+void PDFDeflater::DoStopParallel() noexcept
 {
-   if (!m_file)
-      return;
+   if (m_parallel != nullptr)
+   {
+      m_parallel->Stop();
+      m_parallel->~Parallel();
+      m_resource->deallocate(m_parallel, sizeof(Parallel), alignof(Parallel));
+      m_parallel = nullptr;
+   }
+}
 
-   DoEndPage();
+//---------------------------------------------------------------
+// Compresses the given bytes of data.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::Deflate(const void *data, size_t numBytes)
+{
+   const auto startTime = std::chrono::steady_clock::now();
+   const unsigned char *ucdata = reinterpret_cast<const unsigned char *>(data);
+   m_inputBytes += numBytes;
+   if (m_parallel != nullptr)
+   {
+      if (m_output == nullptr)
+         throw PDFException(__FILEW__, __LINE__, L"Compression has not been started.");
 
-   // Write the "Pages" object with a list of child pages.
-   fprintf(m_file, "\r\n");
-   m_crossRefs.push_back(PDFCrossRef(m_pagesObjNumber, static_cast<size_t>(ftell(m_file))));
-   fprintf(m_file, "%zu 0 obj\r\n", m_pagesObjNumber);
-   fprintf(m_file, "<<\r\n");
-   fprintf(m_file, "/Type /Pages /Kids [");
-   for (const size_t objnum : m_pageObjectNumbers)
-      fprintf(m_file, "%zu 0 R ", objnum);
-   fprintf(m_file, "]\r\n");
-   fprintf(m_file, "/Count %zu\r\n", m_pageObjectNumbers.size());
-   fprintf(m_file, ">>\r\n");
-   fprintf(m_file, "endobj\r\n");
+      // Fill blocks with the data, queuing each full block for the
+      // worker threads.
+      while (numBytes > 0)
+      {
+         Parallel::Block &block = m_parallel->m_blocks[m_parallel->m_fill];
+         size_t length = std::min(numBytes, parallelBlockSize - block.m_inputBytes);
+         memcpy(block.m_input + block.m_dictionaryBytes + block.m_inputBytes, ucdata, length);
+         block.m_inputBytes += length;
+         ucdata += length;
+         numBytes -= length;
+         if (block.m_inputBytes == parallelBlockSize)
+            DoSubmitBlock(false);
+      }
+   }
+   else
+   {
+      // ZLIB's byte counts are 32 bits, so give it large pieces of
+      // data in several parts.
+      const size_t maxPart = 1 << 30;
+      for (size_t offset = 0; offset < numBytes; offset += maxPart)
+         DoDeflate(ucdata + offset, std::min(maxPart, numBytes - offset), Z_NO_FLUSH);
+   }
+   m_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
 
-   // The entries in the cross reference table must be written in
-   // object-number order, so sort the table by object number before
-   // we write it.
-   std::sort(m_crossRefs.begin(), m_crossRefs.end(),
-      [](PDFCrossRef a, PDFCrossRef b){ return a.m_objnum < b.m_objnum; });
+//---------------------------------------------------------------
+// Compresses any remaining data and ends the stream of compressed
+// data.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::Finish()
+{
+   const auto startTime = std::chrono::steady_clock::now();
+   DoFinish();
+   m_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
 
-   // Write the cross reference table.
-   fprintf(m_file, "\r\n");
-   long xrefTableOffset = ftell(m_file);
-   fprintf(m_file, "xref\r\n");
-   fprintf(m_file, "0 %zu\r\n", m_crossRefs.size() + 1); // First line indicates count of entries in table.
-   fprintf(m_file, "0000000000 65535 f\r\n");            // Required dummy first entry.
-   for (const auto &xref : m_crossRefs)
-      fprintf(m_file, "%010zu 00000 n\r\n", xref.m_offset);
+//---------------------------------------------------------------
+// Compresses any remaining data and ends the compressed stream.
+//---------------------------------------------------------------
+void PDFDeflater::DoFinish()
+{
+   if (m_parallel == nullptr)
+   {
+      DoDeflate(nullptr, 0, Z_FINISH);
+      m_output = nullptr;
+      return;
+   }
 
-   // Write the trailer section, which indicates the xref table size and root
-   // object number in the file.  Assumes the root object is object #1.
-   fprintf(m_file, "trailer\r\n");
-   fprintf(m_file, "<< \r\n");
-   time_t tt = {0};
-   int id = static_cast<int>(time(&tt)) + rand();
-   fprintf(m_file, "/ID[<%032d><%032d>]\r\n", id, id);
-   fprintf(m_file, "/Size %zu /Root 1 0 R >>\r\n", m_crossRefs.size() + 1);
+   if (m_output == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Compression has not been started.");
 
-   // Write the "startxref" keyword followed by the offset of the cross reference
-   // table in the PDF file.  PDF reader applications use this to find the cross
-   // reference table.
-   fprintf(m_file, "startxref\r\n");
-   fprintf(m_file, "%ld\r\n", xrefTableOffset);
+   Parallel &p = *m_parallel;
+   Parallel::Block &block = p.m_blocks[p.m_fill];
+   if (!p.m_submitted)
+   {
+      // The data fit in one block, so there's nothing to gain from
+      // the worker threads.  Compress it here, the usual way.
+      {
+         std::lock_guard<std::mutex> lock(p.m_mutex);
+         block.m_state = Parallel::State::Free;
+      }
+      DoDeflate(block.m_input, block.m_inputBytes, Z_FINISH);
+      m_output = nullptr;
+      return;
+   }
 
-   // Lastly, write the PDF's EOF marker.
-   fprintf(m_file, "%%%%EOF\r\n");
+   // Queue the last block, collect the rest of the compressed
+   // data, and end the stream with the checksum of all the data.
+   DoSubmitBlock(true);
+   for (bool collectedLast = false; !collectedLast; )
+   {
+      collectedLast = p.m_blocks[p.m_collect].m_last;
+      DoCollectBlock();
+   }
+   const unsigned char adler[4] = {
+      static_cast<unsigned char>(p.m_adler >> 24), static_cast<unsigned char>(p.m_adler >> 16),
+      static_cast<unsigned char>(p.m_adler >> 8), static_cast<unsigned char>(p.m_adler) };
+   m_output->AddData(adler, sizeof(adler));
+   m_output = nullptr;
+}
 
-   // We're done with the file now.
-   fclose(m_file);
-   m_file = nullptr;
+//---------------------------------------------------------------
+// Abandons the stream of compressed data, if no data has been
+// given to the deflater since Begin.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::Cancel()
+{
+   if (m_output == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Compression has not been started.");
+   if (m_inputBytes > 0)
+      throw PDFException(__FILEW__, __LINE__, L"Compression can't be cancelled after data was compressed.");
+
+   // The next Begin resets the ZLIB stream and the blocks.
+   if (m_parallel != nullptr)
+   {
+      std::lock_guard<std::mutex> lock(m_parallel->m_mutex);
+      m_parallel->m_blocks[m_parallel->m_fill].m_state = Parallel::State::Free;
+   }
+   m_output = nullptr;
+}
+
+//---------------------------------------------------------------
+// Queues the block being filled for the worker threads, and
+// unless it's the last block, starts filling the next block, with
+// the end of this block's data as its dictionary.  Collects the
+// compressed data of finished blocks along the way, waiting for
+// them if all of the blocks are in use.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::DoSubmitBlock(bool last)
+{
+   Parallel &p = *m_parallel;
+   Parallel::Block &block = p.m_blocks[p.m_fill];
+   {
+      std::lock_guard<std::mutex> lock(p.m_mutex);
+      block.m_last = last;
+      block.m_state = Parallel::State::Queued;
+   }
+   p.m_queued.notify_one();
+   p.m_submitted = true;
+   if (last)
+      return;
+
+   const size_t next = (p.m_fill + 1) % p.m_blocks.size();
+   for (;;)
+   {
+      Parallel::State state;
+      {
+         std::lock_guard<std::mutex> lock(p.m_mutex);
+         state = p.m_blocks[p.m_collect].m_state;
+      }
+      if (state == Parallel::State::Done ||
+          (p.m_collect == next && state != Parallel::State::Free))
+         DoCollectBlock();
+      else
+         break;
+   }
+
+   // The worker may be reading this block's data too, which is fine.
+   Parallel::Block &nextBlock = p.m_blocks[next];
+   {
+      std::lock_guard<std::mutex> lock(p.m_mutex);
+      nextBlock.m_state = Parallel::State::Filling;
+   }
+   nextBlock.m_dictionaryBytes = Parallel::dictionarySize;
+   memcpy(nextBlock.m_input,
+          block.m_input + block.m_dictionaryBytes + block.m_inputBytes - Parallel::dictionarySize,
+          Parallel::dictionarySize);
+   nextBlock.m_inputBytes = 0;
+   nextBlock.m_first = false;
+   nextBlock.m_last = false;
+   p.m_fill = next;
+}
+
+//---------------------------------------------------------------
+// Waits for the oldest queued block to be compressed, and adds
+// its compressed data to the output, trimming off the ZLIB header
+// and dictionary ID of all but the first block and the checksum
+// of the last block.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::DoCollectBlock()
+{
+   Parallel &p = *m_parallel;
+   Parallel::Block &block = p.m_blocks[p.m_collect];
+   {
+      std::unique_lock<std::mutex> lock(p.m_mutex);
+      p.m_done.wait(lock, [&block]{ return block.m_state == Parallel::State::Done; });
+      block.m_state = Parallel::State::Free;
+      p.m_collect = (p.m_collect + 1) % p.m_blocks.size();
+   }
+   if (block.m_failed)
+   {
+      m_output = nullptr;
+      throw PDFException(__FILEW__, __LINE__, L"ZLIB compression failed.");
+   }
+
+   size_t start = (block.m_first ? 0 : 6);
+   size_t end = block.m_outputBytes - (block.m_last ? 4 : 0);
+   m_output->AddData(block.m_output + start, end - start);
+   p.m_adler = (block.m_first ? block.m_adler : CombineAdler32(p.m_adler, block.m_adler, block.m_inputBytes));
+}
+
+//---------------------------------------------------------------
+// Passes the given data to ZLIB, adding whatever compressed data
+// it produces to the output stream accumulator.  Errors throw.
+//---------------------------------------------------------------
+void PDFDeflater::DoDeflate(const void *data, size_t numBytes, int flush)
+{
+   if (m_output == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Compression has not been started.");
+
+   z_stream &zs = m_zlib->m_stream;
+   zs.next_in = reinterpret_cast<Bytef *>(const_cast<void *>(data));
+   zs.avail_in = static_cast<uInt>(numBytes);
+   int errcode = Z_OK;
+   do
+   {
+      zs.next_out = m_zlib->m_buffer;
+      zs.avail_out = static_cast<uInt>(sizeof(m_zlib->m_buffer));
+      errcode = deflate(&zs, flush);
+      if (errcode != Z_OK && errcode != Z_STREAM_END && errcode != Z_BUF_ERROR)
+      {
+         m_output = nullptr;
+         throw PDFException(__FILEW__, __LINE__, L"ZLIB compression failed.");
+      }
+      m_output->AddData(m_zlib->m_buffer, sizeof(m_zlib->m_buffer) - zs.avail_out);
+   } while (zs.avail_out == 0 || (flush == Z_FINISH && errcode != Z_STREAM_END));
+}
+
+//---------------------------------------------------------------
+// Allocates memory from the arena.  The memory comes from the
+// current chunk if it fits, else from the next chunk it fits in,
+// else from a new chunk.  Errors throw.
+//---------------------------------------------------------------
+void *PDFPageArena::do_allocate(size_t numBytes, size_t alignment)
+{
+   Chunk *chunk = m_currentChunk;
+   size_t used = m_used;
+   while (chunk != nullptr)
+   {
+      unsigned char *base = reinterpret_cast<unsigned char *>(chunk);
+      const uintptr_t address = (reinterpret_cast<uintptr_t>(base + used) + alignment - 1) &
+         ~static_cast<uintptr_t>(alignment - 1);
+      const size_t offset = static_cast<size_t>(address - reinterpret_cast<uintptr_t>(base));
+      if (offset + numBytes <= chunk->m_size)
+      {
+         m_currentChunk = chunk;
+         m_used = offset + numBytes;
+         return base + offset;
+      }
+      chunk = chunk->m_next;
+      used = sizeof(Chunk);
+   }
+
+   // Add a new chunk to the end of the list.
+   const size_t size = std::max(chunkSize, sizeof(Chunk) + alignment + numBytes);
+   chunk = static_cast<Chunk *>(m_upstream->allocate(size, alignof(std::max_align_t)));
+   chunk->m_next = nullptr;
+   chunk->m_size = size;
+   if (m_lastChunk != nullptr)
+      m_lastChunk->m_next = chunk;
+   else
+      m_firstChunk = chunk;
+   m_lastChunk = chunk;
+   m_capacity += size;
+
+   m_currentChunk = chunk;
+   m_used = sizeof(Chunk);
+   return do_allocate(numBytes, alignment);
+}
+
+//---------------------------------------------------------------
+// Makes all of the arena's memory available for reuse.
+//---------------------------------------------------------------
+void PDFPageArena::Reset()
+{
+   m_currentChunk = m_firstChunk;
+   m_used = sizeof(Chunk);
+}
+
+//---------------------------------------------------------------
+// Gives all of the arena's chunks back to the upstream memory
+// resource.
+//---------------------------------------------------------------
+void PDFPageArena::Trim()
+{
+   while (m_firstChunk != nullptr)
+   {
+      Chunk *chunk = m_firstChunk;
+      m_firstChunk = chunk->m_next;
+      m_upstream->deallocate(chunk, chunk->m_size, alignof(std::max_align_t));
+   }
+   m_lastChunk = m_currentChunk = nullptr;
+   m_used = 0;
+   m_capacity = 0;
+}
+
+//---------------------------------------------------------------
+// Adds the given bytes of binary data to the stream.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::AddData(const void *data, size_t numBytes)
+{
+   const unsigned char *ucdata = reinterpret_cast<const unsigned char *>(data);
+   while (numBytes > 0)
+   {
+      if (m_writePos == m_writeEnd)
+         DoAddBlock();
+
+      const size_t count = std::min(numBytes, static_cast<size_t>(m_writeEnd - m_writePos));
+      memcpy(m_writePos, ucdata, count);
+      m_writePos += count;
+      ucdata += count;
+      numBytes -= count;
+   }
+}
+
+//---------------------------------------------------------------
+// Adds an empty block to the end of the stream, after spilling
+// the stream's data to the temporary file if the data in memory
+// has reached the spill threshold.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::DoAddBlock()
+{
+   // When compressing or writing to a file as data is added, the
+   // one full block is passed on and then reused.
+   if ((m_deflater != nullptr || m_writeThroughSink != nullptr) && !m_blocks.empty())
+   {
+      DoPassOn(m_blocks.back(), PDFBlockPool::blockSize);
+      m_writePos = m_blocks.back();
+      m_writeEnd = m_writePos + PDFBlockPool::blockSize;
+      return;
+   }
+
+   if (m_spillThreshold != 0 && m_blocks.size() * PDFBlockPool::blockSize >= m_spillThreshold)
+      DoSpill();
+
+   m_blocks.push_back(m_pool->Acquire());
+   m_writePos = m_blocks.back();
+   m_writeEnd = m_writePos + PDFBlockPool::blockSize;
+}
+
+//---------------------------------------------------------------
+// Moves the stream's data that's in memory to the end of the
+// temporary spill file, creating the file if needed, and gives
+// the blocks back to the pool.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::DoSpill()
+{
+   if (m_spillFile == nullptr && (tmpfile_s(&m_spillFile) || m_spillFile == nullptr))
+      throw PDFException(__FILEW__, __LINE__, L"Failed creating temporary file for stream data.");
+
+   const size_t numBytes = size() - m_spilledBytes;
+   for (size_t i = 0; i < m_blocks.size(); i++)
+   {
+      const size_t count = std::min(numBytes - i * PDFBlockPool::blockSize, PDFBlockPool::blockSize);
+      if (fwrite(m_blocks[i], 1, count, m_spillFile) != count)
+         throw PDFException(__FILEW__, __LINE__, L"Failed writing stream data to temporary file.");
+      m_pool->Release(m_blocks[i]);
+   }
+
+   m_spilledBytes += numBytes;
+   m_blocks.clear();
+   m_writePos = m_writeEnd = nullptr;
+}
+
+//---------------------------------------------------------------
+// Discards any accumulated data, giving its blocks back to the
+// pool.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::clear()
+{
+   if (m_spillFile != nullptr)
+   {
+      // The temporary file is deleted automatically when closed.
+      fclose(m_spillFile);
+      m_spillFile = nullptr;
+   }
+   m_spilledBytes = 0;
+   m_deflater = nullptr;
+   m_writeThroughSink = nullptr;
+   m_passedOnBytes = 0;
+
+   for (unsigned char *block : m_blocks)
+      m_pool->Release(block);
+   m_blocks.clear();
+   m_writePos = m_writeEnd = nullptr;
+}
+
+//---------------------------------------------------------------
+// Calls the given function for each consecutive piece of the
+// stream's data, in order.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::ForEachChunk(
+   const std::function<void(const unsigned char *data, size_t numBytes)> &function) const
+{
+   // Read back any data that was spilled to the temporary file,
+   // a block at a time.
+   if (m_spillFile != nullptr)
+   {
+      unsigned char *chunk = m_pool->Acquire();
+      try
+      {
+         fflush(m_spillFile);
+         rewind(m_spillFile);
+         for (size_t remaining = m_spilledBytes; remaining > 0; )
+         {
+            const size_t numBytes = std::min(remaining, PDFBlockPool::blockSize);
+            if (fread(chunk, 1, numBytes, m_spillFile) != numBytes)
+               throw PDFException(__FILEW__, __LINE__, L"Failed reading stream data from temporary file.");
+            function(chunk, numBytes);
+            remaining -= numBytes;
+         }
+         fseek(m_spillFile, 0, SEEK_END);
+      }
+      catch (...)
+      {
+         m_pool->Release(chunk);
+         throw;
+      }
+      m_pool->Release(chunk);
+   }
+
+   // Then the blocks in memory.
+   const size_t numBytes = size() - m_spilledBytes;
+   for (size_t i = 0; i < m_blocks.size(); i++)
+   {
+      const size_t count = std::min(numBytes - i * PDFBlockPool::blockSize, PDFBlockPool::blockSize);
+      if (count > 0)
+         function(m_blocks[i], count);
+   }
+}
+
+//---------------------------------------------------------------
+// Starts compressing the stream's data with the given deflater as
+// the data is added.  The stream must be empty.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::BeginDeflate(PDFDeflater &deflater)
+{
+   if (size() != 0 || m_writeThroughSink != nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Stream must be empty to begin compression.");
+   if (!deflater.IsActive())
+      throw PDFException(__FILEW__, __LINE__, L"Compression has not been started.");
+
+   m_deflater = &deflater;
+}
+
+//---------------------------------------------------------------
+// Compresses the rest of the stream's data and finishes the
+// deflater's stream of compressed data.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::EndDeflate()
+{
+   if (m_deflater == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Compression has not been started.");
+
+   DoPassOnLastBlock();
+   PDFDeflater *deflater = m_deflater;
+   m_deflater = nullptr;
+   deflater->Finish();
+}
+
+//---------------------------------------------------------------
+// Stops compressing the stream's data and cancels the deflater,
+// if none of the data has been given to the deflater yet.
+// Returns true if so.  Errors throw.
+//---------------------------------------------------------------
+bool PDFStreamAccumulator::CancelDeflate()
+{
+   if (m_deflater == nullptr || m_passedOnBytes > 0)
+      return false;
+
+   PDFDeflater *deflater = m_deflater;
+   m_deflater = nullptr;
+   deflater->Cancel();
+   return true;
+}
+
+//---------------------------------------------------------------
+// Starts writing the stream's data to the given sink as the data
+// is added.  The stream must be empty.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::BeginWriteThrough(PDFOutputSink &sink)
+{
+   if (size() != 0 || m_deflater != nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Stream must be empty to begin writing to file.");
+
+   m_writeThroughSink = &sink;
+}
+
+//---------------------------------------------------------------
+// Writes the rest of the stream's data to the sink given to
+// BeginWriteThrough.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::EndWriteThrough()
+{
+   if (m_writeThroughSink == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Writing to file has not been started.");
+
+   DoPassOnLastBlock();
+   m_writeThroughSink = nullptr;
+}
+
+//---------------------------------------------------------------
+// Passes the given data on to the deflater or to the sink, if
+// either is in effect.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::DoPassOn(const unsigned char *data, size_t numBytes)
+{
+   if (m_deflater != nullptr)
+      m_deflater->Deflate(data, numBytes);
+   else
+      m_writeThroughSink->Write(data, numBytes);
+   m_passedOnBytes += numBytes;
+}
+
+//---------------------------------------------------------------
+// Passes on the data in the last (partial) block, if any, and
+// gives the block back to the pool.  Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::DoPassOnLastBlock()
+{
+   if (!m_blocks.empty())
+   {
+      DoPassOn(m_blocks.back(), PDFBlockPool::blockSize - static_cast<size_t>(m_writeEnd - m_writePos));
+      m_pool->Release(m_blocks.back());
+      m_blocks.clear();
+      m_writePos = m_writeEnd = nullptr;
+   }
+}
+
+//---------------------------------------------------------------
+// Writes all of the stream's data to the given sink.
+// Errors throw.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::WriteTo(PDFOutputSink &sink) const
+{
+   ForEachChunk([&sink](const unsigned char *data, size_t numBytes)
+   {
+      sink.Write(data, numBytes);
+   });
+}
+
+//---------------------------------------------------------------
+// Adds formatted text to the stream.
+// Formatting is the same as printf in the runtime library.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::Printf(const char *format, ...)
+{
+   // Most formatted strings fit in a small buffer on the stack, so
+   // try that before resorting to a heap allocated buffer.
+   char stackBuffer[256];
+   std::va_list args;
+   va_start(args, format);
+   int length = _vsnprintf_s(stackBuffer, sizeof(stackBuffer), _TRUNCATE, format, args);
+   va_end(args);
+   if (length != -1)
+   {
+      AddData(stackBuffer, static_cast<size_t>(length));
+      return;
+   }
+
+   // The text didn't fit, so format it in a block from the pool
+   // instead.  Text that doesn't fit in a block is dropped.
+   char *block = reinterpret_cast<char *>(m_pool->Acquire());
+   try
+   {
+      va_start(args, format);
+      length = _vsnprintf_s(block, PDFBlockPool::blockSize, _TRUNCATE, format, args);
+      va_end(args);
+      if (length != -1)
+         AddData(block, static_cast<size_t>(length));
+   }
+   catch (...)
+   {
+      m_pool->Release(reinterpret_cast<unsigned char *>(block));
+      throw;
+   }
+   m_pool->Release(reinterpret_cast<unsigned char *>(block));
+}
+
+//---------------------------------------------------------------
+// Adds a number to the stream as fixed-point text followed by a
+// space.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::AddNumber(double value)
+{
+   char buffer[40];
+   size_t length = FormatNumber(buffer, value);
+   buffer[length++] = ' ';
+   AddData(buffer, length);
+}
+
+//---------------------------------------------------------------
+// Formats a number the same way as AddNumber, but into the given
+// buffer instead of the stream.
+//---------------------------------------------------------------
+size_t PDFStreamAccumulator::FormatNumber(char *buffer, double value) const
+{
+   return ::FormatNumber(buffer, value, m_decimals);
+}
+
+//---------------------------------------------------------------
+// Formats an integer into the given buffer.
+//---------------------------------------------------------------
+size_t PDFStreamAccumulator::FormatInteger(char *buffer, long long value)
+{
+   return FormatSigned(buffer, value);
+}
+
+//---------------------------------------------------------------
+// Formats a number with as many decimal places as FormatNumber
+// supports.
+//---------------------------------------------------------------
+size_t PDFStreamAccumulator::FormatExactNumber(char *buffer, double value)
+{
+   return ::FormatNumber(buffer, value, 9);
+}
+
+//---------------------------------------------------------------
+// Adds an integer to the stream followed by a space.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::AddInteger(long long value)
+{
+   char buffer[32];
+   size_t length = FormatSigned(buffer, value);
+   buffer[length++] = ' ';
+   AddData(buffer, length);
+}
+
+//---------------------------------------------------------------
+// Adds a content stream operator to the stream, followed by a
+// line break.
+//---------------------------------------------------------------
+void PDFStreamAccumulator::AddOperator(const char *op)
+{
+   char buffer[16];
+   size_t length = strlen(op);
+   if (length + 2 > sizeof(buffer))
+   {
+      AddData(op, length);
+      AddData("\r\n", 2);
+      return;
+   }
+   memcpy(buffer, op, length);
+   buffer[length++] = '\r';
+   buffer[length++] = '\n';
+   AddData(buffer, length);
+}
+
+//---------------------------------------------------------------
+// Creates the given file for writing.  Errors throw.
+//---------------------------------------------------------------
+void PDFFileSink::Open(const std::wstring &filename)
+{
+   Close();
+   if (_wfopen_s(&m_file, filename.c_str(), L"wb") || m_file == nullptr)
+   {
+      m_file = nullptr;
+      throw PDFException(__FILEW__, __LINE__,
+               std::wstring(L"Failed opening file for writing:  ") + filename);
+   }
+   m_written = 0;
+   m_preallocated = 0;
+   m_preallocate = true;
+}
+
+//---------------------------------------------------------------
+// Closes the file, if it's open.
+//---------------------------------------------------------------
+void PDFFileSink::Close()
+{
+   if (m_file != nullptr)
+   {
+      DoTrim();
+      fclose(m_file);
+      m_file = nullptr;
+   }
+}
+
+//---------------------------------------------------------------
+// Sets aside disk space for the file up to the given size, without
+// changing the file's size.  Returns false if that fails or isn't
+// supported.
+//---------------------------------------------------------------
+bool PDFFileSink::DoAllocate(size_t numBytes)
+{
+#if defined(_WIN32)
+   FILE_ALLOCATION_INFO info;
+   info.AllocationSize.QuadPart = static_cast<LONGLONG>(numBytes);
+   return SetFileInformationByHandle(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(m_file))),
+                                     FileAllocationInfo, &info, sizeof(info)) != FALSE;
+#elif defined(__linux__)
+   return fallocate(fileno(m_file), FALLOC_FL_KEEP_SIZE, static_cast<off_t>(m_preallocated),
+                    static_cast<off_t>(numBytes - m_preallocated)) == 0;
+#else
+   (void)numBytes;
+   return false;
+#endif
+}
+
+//---------------------------------------------------------------
+// Gives back any disk space that was set aside past the end of
+// the data written.  Returns false if that fails.
+//---------------------------------------------------------------
+bool PDFFileSink::DoTrim()
+{
+   if (m_preallocated <= m_written)
+      return true;
+   m_preallocated = 0;
+   if (fflush(m_file) != 0)
+      return false;
+#if defined(_WIN32)
+   return DoAllocate(m_written);
+#elif defined(__linux__)
+   // Truncating to the same size frees the blocks past the end.
+   return ftruncate(fileno(m_file), static_cast<off_t>(m_written)) == 0;
+#else
+   return true;
+#endif
+}
+
+//---------------------------------------------------------------
+// Writes the given bytes of data to the file.  Errors throw.
+//---------------------------------------------------------------
+void PDFFileSink::Write(const void *data, size_t numBytes)
+{
+   if (m_file == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"Failed writing to PDF file.");
+
+   // Set aside disk space for the file well ahead of the writes, so
+   // the file's blocks are allocated in large contiguous pieces.
+   // The file's size doesn't change, so if the program ends before
+   // the file is closed, the file holds just the data written, but
+   // the disk space past it isn't given back until the file is
+   // closed (see DoTrim).  If it fails, it's not tried again for
+   // this file.
+   static constexpr size_t preallocateSize = 16 * 1024 * 1024;
+   if (m_preallocate && m_written + numBytes > m_preallocated)
+   {
+      const size_t size = m_preallocated + std::max(preallocateSize, numBytes);
+      if (DoAllocate(size))
+         m_preallocated = size;
+      else
+         m_preallocate = false;
+   }
+
+   if (fwrite(data, 1, numBytes, m_file) != numBytes)
+      throw PDFException(__FILEW__, __LINE__, L"Failed writing to PDF file.");
+   m_written += numBytes;
+}
+
+//---------------------------------------------------------------
+// Closes the file after the last of the data has been written,
+// which makes sure all of the data actually made it to the file.
+// Errors throw.
+//---------------------------------------------------------------
+void PDFFileSink::Finish()
+{
+   if (m_file == nullptr)
+      return;
+   const bool trimmed = DoTrim();
+   FILE *file = m_file;
+   m_file = nullptr;
+   if (fclose(file) != 0 || !trimmed)
+      throw PDFException(__FILEW__, __LINE__, L"Failed writing to PDF file.");
+}
+
+//---------------------------------------------------------------
+// Sets the sink that the data is passed on to.  Errors throw.
+//---------------------------------------------------------------
+void PDFObjectWriter::SetSink(PDFOutputSink *sink)
+{
+   m_sink = sink;
+   m_offset = 0;
+   if (sink == nullptr)
+      DoFreeBuffer();
+   else if (m_buffer == nullptr)
+      m_buffer = static_cast<char *>(m_resource->allocate(bufferSize, 1));
+   m_pos = m_buffer;
+   m_end = (m_buffer != nullptr ? m_buffer + bufferSize : nullptr);
+}
+
+//---------------------------------------------------------------
+// Gives the buffer back to the memory resource.
+//---------------------------------------------------------------
+void PDFObjectWriter::DoFreeBuffer() noexcept
+{
+   if (m_buffer != nullptr)
+      m_resource->deallocate(m_buffer, bufferSize, 1);
+   m_buffer = m_pos = m_end = nullptr;
+}
+
+//---------------------------------------------------------------
+// Writes data that doesn't fit in the rest of the buffer.  Data
+// at least as big as the buffer is passed straight on to the sink
+// instead of being copied to the buffer.  Errors throw.
+//---------------------------------------------------------------
+void PDFObjectWriter::DoWriteLarge(const void *data, size_t numBytes)
+{
+   if (m_sink == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"No PDF file is open for writing.");
+
+   Flush();
+   if (numBytes >= bufferSize)
+   {
+      m_sink->Write(data, numBytes);
+      m_offset += numBytes;
+   }
+   else
+      Write(data, numBytes);
+}
+
+//---------------------------------------------------------------
+// Writes the given unsigned integer as decimal text.
+// Errors throw.
+//---------------------------------------------------------------
+void PDFObjectWriter::WriteUnsigned(size_t value)
+{
+   char buffer[24];
+   char *end = buffer + sizeof(buffer);
+   char *p = end;
+   do
+   {
+      *--p = static_cast<char>('0' + value % 10);
+      value /= 10;
+   } while (value != 0);
+   Write(p, static_cast<size_t>(end - p));
+}
+
+//---------------------------------------------------------------
+// Writes formatted text.  Formatting is the same as printf in the
+// runtime library.  Errors throw.
+//---------------------------------------------------------------
+void PDFObjectWriter::Printf(const char *format, ...)
+{
+   // Nothing written with this is longer than a line of text, so
+   // format it straight into the buffer.
+   static constexpr size_t maxLength = 1024;
+   char *space = GetSpace(maxLength);
+   std::va_list args;
+   va_start(args, format);
+   int length = _vsnprintf_s(space, maxLength, _TRUNCATE, format, args);
+   va_end(args);
+   if (length == -1)
+      throw PDFException(__FILEW__, __LINE__, L"Formatted text too long for PDF file.");
+   Commit(static_cast<size_t>(length));
+}
+
+//---------------------------------------------------------------
+// Passes the data in the buffer on to the sink.  Errors throw.
+//---------------------------------------------------------------
+void PDFObjectWriter::Flush()
+{
+   if (m_sink == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"No PDF file is open for writing.");
+
+   if (m_pos != m_buffer)
+   {
+      size_t numBytes = static_cast<size_t>(m_pos - m_buffer);
+      m_pos = m_buffer;
+      m_sink->Write(m_buffer, numBytes);
+   }
+}
+
+//---------------------------------------------------------------
+// Passes the rest of the data on to the sink and finishes the
+// sink.  Errors throw.
+//---------------------------------------------------------------
+void PDFObjectWriter::Finish()
+{
+   Flush();
+   m_sink->Finish();
+}
+
+//---------------------------------------------------------------
+// Starts the writer thread, which passes the data on to the given
+// sink.  Errors throw.
+//---------------------------------------------------------------
+void PDFAsyncSink::Start(PDFOutputSink &sink, size_t queueDepth)
+{
+   Stop();
+
+   // One buffer is filled in while the rest are queued.
+   size_t numBuffers = std::max<size_t>(queueDepth, 1) + 1;
+   try
+   {
+      m_freeBuffers.reserve(numBuffers);
+      m_queue.resize(numBuffers);
+      for (size_t count = 0; count < numBuffers; ++count)
+      {
+         m_freeBuffers.push_back(static_cast<char *>(m_resource->allocate(bufferSize, 1)));
+         ++m_numBuffers;
+      }
+   }
+   catch (...)
+   {
+      DoFreeBuffers();
+      throw;
+   }
+   m_current = m_freeBuffers.back();
+   m_freeBuffers.pop_back();
+   m_currentBytes = 0;
+   m_sink = &sink;
+   m_finishing = false;
+   m_stopping = false;
+   m_error = nullptr;
+
+   try
+   {
+      m_thread = std::thread(&PDFAsyncSink::DoWriterThread, this);
+   }
+   catch (const std::system_error &)
+   {
+      DoFreeBuffers();
+      throw PDFException(__FILEW__, __LINE__, L"Failed starting PDF writer thread.");
+   }
+}
+
+//---------------------------------------------------------------
+// Stops the writer thread without finishing the other sink.
+//---------------------------------------------------------------
+void PDFAsyncSink::Stop() noexcept
+{
+   if (m_thread.joinable())
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_stopping = true;
+      }
+      m_changed.notify_all();
+      m_thread.join();
+   }
+   DoFreeBuffers();
+   m_sink = nullptr;
+}
+
+//---------------------------------------------------------------
+// Gives all of the buffers back to the memory resource.  The
+// writer thread must not be running.
+//---------------------------------------------------------------
+void PDFAsyncSink::DoFreeBuffers() noexcept
+{
+   for (; m_queueCount > 0; --m_queueCount, ++m_queueFirst)
+      m_freeBuffers.push_back(m_queue[m_queueFirst % m_numBuffers].m_data);
+   m_queueFirst = 0;
+   if (m_current != nullptr)
+      m_freeBuffers.push_back(m_current);
+   m_current = nullptr;
+   m_currentBytes = 0;
+   for (char *buffer : m_freeBuffers)
+      m_resource->deallocate(buffer, bufferSize, 1);
+   m_freeBuffers.clear();
+   m_queue.clear();
+   m_numBuffers = 0;
+}
+
+//---------------------------------------------------------------
+// Copies the given data to the buffers, handing each buffer to the
+// writer thread as it's filled.  Errors throw.
+//---------------------------------------------------------------
+void PDFAsyncSink::Write(const void *data, size_t numBytes)
+{
+   if (m_current == nullptr)
+      throw PDFException(__FILEW__, __LINE__, L"PDF writer thread is not running.");
+
+   const char *cdata = reinterpret_cast<const char *>(data);
+   while (numBytes > 0)
+   {
+      size_t length = std::min(numBytes, bufferSize - m_currentBytes);
+      memcpy(m_current + m_currentBytes, cdata, length);
+      m_currentBytes += length;
+      cdata += length;
+      numBytes -= length;
+      if (m_currentBytes == bufferSize)
+         DoHandOff();
+   }
+}
+
+//---------------------------------------------------------------
+// Queues the buffer being filled in for the writer thread, and
+// waits for a free buffer to fill in next.  Errors from the
+// writer thread throw.
+//---------------------------------------------------------------
+void PDFAsyncSink::DoHandOff()
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   if (m_error)
+      std::rethrow_exception(m_error);
+
+   DoQueue();
+   m_changed.notify_all();
+
+   m_changed.wait(lock, [this]{ return !m_freeBuffers.empty(); });
+   m_current = m_freeBuffers.back();
+   m_freeBuffers.pop_back();
+}
+
+//---------------------------------------------------------------
+// Adds the buffer being filled in to the end of the queue.  The
+// mutex must be locked.
+//---------------------------------------------------------------
+void PDFAsyncSink::DoQueue()
+{
+   m_queue[(m_queueFirst + m_queueCount) % m_numBuffers] = Buffer{m_current, m_currentBytes};
+   ++m_queueCount;
+   m_current = nullptr;
+   m_currentBytes = 0;
+}
+
+//---------------------------------------------------------------
+// Waits for all of the data to be written, stops the writer
+// thread, and finishes the other sink.  Errors throw.
+//---------------------------------------------------------------
+void PDFAsyncSink::Finish()
+{
+   if (!m_thread.joinable())
+      throw PDFException(__FILEW__, __LINE__, L"PDF writer thread is not running.");
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_currentBytes > 0)
+         DoQueue();
+      m_finishing = true;
+   }
+   m_changed.notify_all();
+   m_thread.join();
+
+   PDFOutputSink *sink = m_sink;
+   std::exception_ptr error = m_error;
+   Stop();
+   if (error)
+      std::rethrow_exception(error);
+   sink->Finish();
+}
+
+//---------------------------------------------------------------
+// Writer thread, which passes the queued buffers on to the other
+// sink in order until the data is finished or the thread is
+// stopped.  After an error, the rest of the data is discarded.
+//---------------------------------------------------------------
+void PDFAsyncSink::DoWriterThread()
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   for (;;)
+   {
+      m_changed.wait(lock, [this]{ return m_stopping || m_finishing || m_queueCount > 0; });
+      if (m_stopping || m_queueCount == 0)
+         break;
+
+      Buffer buffer = m_queue[m_queueFirst];
+      lock.unlock();
+      std::exception_ptr error;
+      if (!m_error)
+      {
+         try
+         {
+            m_sink->Write(buffer.m_data, buffer.m_numBytes);
+         }
+         catch (...)
+         {
+            error = std::current_exception();
+         }
+      }
+      lock.lock();
+
+      if (error)
+         m_error = error;
+      m_queueFirst = (m_queueFirst + 1) % m_numBuffers;
+      --m_queueCount;
+      m_freeBuffers.push_back(buffer.m_data);
+      m_changed.notify_all();
+   }
+}
+
+//---------------------------------------------------------------
+// Sets the most data to hold before the writer waits (if
+// blocking) or the sink reports that it's full.
+//---------------------------------------------------------------
+void PDFPullSink::SetHighWaterMark(size_t numBytes, bool blocking)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_highWaterMark = std::max<size_t>(numBytes, 1);
+   m_blocking = blocking;
+   m_changed.notify_all();
+}
+
+//---------------------------------------------------------------
+// Discards any data held and gets ready for a new PDF file.
+//---------------------------------------------------------------
+void PDFPullSink::Reset()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_data.clear();
+   m_readPos = 0;
+   m_finished = false;
+   m_cancelled = false;
+   m_changed.notify_all();
+}
+
+//---------------------------------------------------------------
+// Copies up to the given number of bytes of the next data to the
+// given buffer, and returns the number of bytes copied.
+//---------------------------------------------------------------
+size_t PDFPullSink::Read(void *buffer, size_t maxBytes)
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   if (m_blocking)
+      m_changed.wait(lock, [this]{ return DoHeldBytes() > 0 || m_finished || m_cancelled; });
+
+   size_t numBytes = std::min(maxBytes, DoHeldBytes());
+   memcpy(buffer, m_data.data() + m_readPos, numBytes);
+   m_readPos += numBytes;
+
+   // Move the unread data to the front once at least half of the
+   // data has been read, so the data held doesn't keep growing.
+   if (m_readPos == m_data.size())
+   {
+      m_data.clear();
+      m_readPos = 0;
+   }
+   else if (m_readPos >= m_data.size() / 2)
+   {
+      m_data.erase(m_data.begin(), m_data.begin() + static_cast<ptrdiff_t>(m_readPos));
+      m_readPos = 0;
+   }
+   if (numBytes > 0)
+      m_changed.notify_all();
+   return numBytes;
+}
+
+//---------------------------------------------------------------
+// Returns true if the data held is at the high-water mark.
+//---------------------------------------------------------------
+bool PDFPullSink::IsFull() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return DoHeldBytes() >= m_highWaterMark;
+}
+
+//---------------------------------------------------------------
+// Returns true if the PDF file is finished and all of its data
+// has been read.
+//---------------------------------------------------------------
+bool PDFPullSink::IsComplete() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_finished && DoHeldBytes() == 0;
+}
+
+//---------------------------------------------------------------
+// Makes any further writes throw.
+//---------------------------------------------------------------
+void PDFPullSink::Cancel()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_cancelled = true;
+   m_changed.notify_all();
+}
+
+//---------------------------------------------------------------
+// Adds the given data for the reader.  If blocking, only adds as
+// much as fits under the high-water mark at a time, waiting for
+// the reader to make room.  Errors throw.
+//---------------------------------------------------------------
+void PDFPullSink::Write(const void *data, size_t numBytes)
+{
+   const unsigned char *ucdata = reinterpret_cast<const unsigned char *>(data);
+   std::unique_lock<std::mutex> lock(m_mutex);
+   while (numBytes > 0)
+   {
+      if (m_blocking)
+         m_changed.wait(lock, [this]{ return DoHeldBytes() < m_highWaterMark || m_cancelled; });
+      if (m_cancelled)
+         throw PDFException(__FILEW__, __LINE__, L"PDF output was cancelled by the reader.");
+
+      size_t length = numBytes;
+      if (m_blocking)
+         length = std::min(length, m_highWaterMark - DoHeldBytes());
+
+      // Move the unread data to the front rather than growing.
+      if (m_readPos > 0 && m_data.size() + length > m_data.capacity())
+      {
+         m_data.erase(m_data.begin(), m_data.begin() + static_cast<ptrdiff_t>(m_readPos));
+         m_readPos = 0;
+      }
+      if (m_blocking && m_data.capacity() < m_highWaterMark)
+         m_data.reserve(m_highWaterMark);
+      m_data.insert(m_data.end(), ucdata, ucdata + length);
+      ucdata += length;
+      numBytes -= length;
+      m_changed.notify_all();
+   }
+}
+
+//---------------------------------------------------------------
+// Marks the end of the PDF file's data, so the reader sees it
+// once all of the data has been read.  Errors throw.
+//---------------------------------------------------------------
+void PDFPullSink::Finish()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   if (m_cancelled)
+      throw PDFException(__FILEW__, __LINE__, L"PDF output was cancelled by the reader.");
+   m_finished = true;
+   m_changed.notify_all();
+}
+
+//---------------------------------------------------------------
+Draw2pdf::~Draw2pdf()
+{
+   // An error finishing the file can't be thrown from here, so it's
+   // lost.  Call Close first to find out about it.
+   try
+   {
+      Close();
+   }
+   catch (...)
+   {
+   }
+}
+
+//---------------------------------------------------------------
+// Opens a new PDF file for writing.  Errors throw.
+// The dimensions of the page(s) in the PDF file should be given
+// in units of typesetting points (1 point = 1/72 inch).
+//---------------------------------------------------------------
+void Draw2pdf::Open(const std::wstring &filename,
+         const PDFPoint &pageMinimumPoints,
+         const PDFPoint &pageMaximumPoints,
+         size_t integerUnitsPerPoint)
+{
+   DoCheckUnitsPerPoint(integerUnitsPerPoint);
+   Close();
+   m_fileSink.Open(filename);
+   Open(m_fileSink, pageMinimumPoints, pageMaximumPoints, integerUnitsPerPoint);
+}
+
+//---------------------------------------------------------------
+// Starts a new PDF file, which is written to the given output
+// sink.  Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::Open(PDFOutputSink &sink,
+         const PDFPoint &pageMinimumPoints,
+         const PDFPoint &pageMaximumPoints,
+         size_t integerUnitsPerPoint)
+{
+   DoCheckUnitsPerPoint(integerUnitsPerPoint);
+   if (&sink != &m_fileSink)
+      Close();
+   m_content.SetUnitsPerPoint(static_cast<double>(integerUnitsPerPoint));
+   m_pageMinimumPoints = pageMinimumPoints;
+   m_pageStats.clear();
+   m_streamStats.clear();
+   m_pageMaximumPoints = pageMaximumPoints;
+   // Reading already decouples drawing from the reader, so it
+   // doesn't need the writer thread.
+   if (m_asyncOutput && &sink != &m_pullSink)
+   {
+      m_asyncSink.Start(sink);
+      m_output.SetSink(&m_asyncSink);
+   }
+   else
+      m_output.SetSink(&sink);
+
+   // Write the PDF file signature to the beginning of the file.
+   m_output.WriteText("%PDF-1.4\r\n");
+   m_output.WriteText("%\xC0\xE1\xD2\xC3\xB4\r\n");
+   m_output.WriteText("%PDF file generated by draw2pdf.lib\r\n");
+
+   // Reserve the object numbers for the catalog object and the
+   // "Pages" object, which are written when the file is closed.
+   m_catalogObjNumber = m_objNumber++;
+   m_pagesObjNumber = m_objNumber++;
+
+   DoBeginPage();
+}
+
+//---------------------------------------------------------------
+// Starts a new PDF file whose data is pulled out with ReadOutput.
+// Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::OpenForReading(const PDFPoint &pageMinimumPoints,
+         const PDFPoint &pageMaximumPoints,
+         size_t integerUnitsPerPoint)
+{
+   DoCheckUnitsPerPoint(integerUnitsPerPoint);
+   Close();
+   m_pullSink.Reset();
+   m_pullSink.SetHighWaterMark(m_pullHighWaterMark, m_pullBlocking);
+   Open(m_pullSink, pageMinimumPoints, pageMaximumPoints, integerUnitsPerPoint);
+   m_flushPages = true;
+}
+
+//---------------------------------------------------------------
+// Checks the number of units per point given for integer
+// coordinate mode.  Too many would scale the page by less than
+// the numbers in the content stream can hold, and overflow the
+// integer coordinates.  Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::DoCheckUnitsPerPoint(size_t integerUnitsPerPoint)
+{
+   if (integerUnitsPerPoint > maxIntegerUnitsPerPoint)
+      throw PDFException(__FILEW__, __LINE__, L"Too many integer units per point.");
+}
+
+//---------------------------------------------------------------
+// Finishes writing the currently open PDF file.  If that fails,
+// the file is abandoned, so either way no file is open afterward.
+// Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::Close()
+{
+   if (m_output.GetSink() == nullptr)
+      return;
+
+   try
+   {
+      DoFinishFile();
+   }
+   catch (...)
+   {
+      // A reader waiting for the rest of the data would wait forever.
+      if (m_output.GetSink() == &m_pullSink)
+         m_pullSink.Cancel();
+      DoEndFile();
+      throw;
+   }
+   DoEndFile();
+}
+
+//---------------------------------------------------------------
+// Writes the rest of the currently open PDF file and finishes the
+// output sink.  Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::DoFinishFile()
+{
+   DoEndPage();
+
+   // Write the "Pages" object with a list of child pages.
+   DoBeginObject(m_pagesObjNumber);
+   m_output.WriteText("<<\r\n");
+   m_output.WriteText("/Type /Pages /Kids [");
+   for (const size_t objnum : m_pageObjectNumbers)
+   {
+      m_output.WriteUnsigned(objnum);
+      m_output.WriteText(" 0 R ");
+   }
+   m_output.WriteText("]\r\n");
+   m_output.Printf("/Count %zu\r\n", m_pageObjectNumbers.size());
+   m_output.WriteText(">>\r\n");
+   m_output.WriteText("endobj\r\n");
+
+   // The classic cross reference table can only hold offsets of up
+   // to 10 digits, so a bigger file needs a cross reference stream,
+   // which needs PDF 1.5.  The catalog object is the last object
+   // before the cross reference data, and it starts right after the
+   // blank line that DoBeginObject writes.
+   const bool useCrossRefStream = m_crossRefStream ||
+      m_output.GetOffset() + 2 > maxCrossRefTableOffset;
+
+   // Write the catalog object, which is the root object of the PDF
+   // file.  It's written last so that it can ask for PDF 1.5.
+   DoBeginObject(m_catalogObjNumber);
+   m_output.WriteText("<<\r\n");
+   m_output.WriteText("/Type /Catalog\r\n");
+   if (useCrossRefStream)
+      m_output.WriteText("/Version /1.5\r\n");
+   m_output.Printf("/Pages %zu 0 R\r\n", m_pagesObjNumber);
+   m_output.WriteText(">>\r\n");
+   m_output.WriteText("endobj\r\n");
+
+   // The entries in the cross reference table must be written in
+   // object-number order, so sort the table by object number before
+   // we write it.
+   std::sort(m_crossRefs.begin(), m_crossRefs.end(),
+      [](PDFCrossRef a, PDFCrossRef b){ return a.m_objnum < b.m_objnum; });
+
+   time_t tt = {0};
+   int id = static_cast<int>(time(&tt)) + rand();
+   uint64_t xrefOffset = 0;
+   if (useCrossRefStream)
+   {
+      xrefOffset = DoWriteCrossRefStream(id);
+   }
+   else
+   {
+      // Write the cross reference table.
+      m_output.WriteText("\r\n");
+      xrefOffset = m_output.GetOffset();
+      DoWriteCrossRefTable();
+
+      // Write the trailer section, which indicates the xref table size and root
+      // object number in the file.  Assumes the root object is object #1.
+      m_output.WriteText("trailer\r\n");
+      m_output.WriteText("<< \r\n");
+      m_output.Printf("/ID[<%032d><%032d>]\r\n", id, id);
+      m_output.Printf("/Size %zu /Root 1 0 R >>\r\n", m_crossRefs.size() + 1);
+   }
+
+   // Write the "startxref" keyword followed by the offset of the cross reference
+   // table in the PDF file.  PDF reader applications use this to find the cross
+   // reference table.
+   m_output.WriteText("startxref\r\n");
+   m_output.Printf("%llu\r\n", static_cast<unsigned long long>(xrefOffset));
+
+   // Lastly, write the PDF's EOF marker.
+   m_output.WriteText("%%EOF\r\n");
+
+   // We're done with the file now.
+   m_output.Finish();
+}
+
+//---------------------------------------------------------------
+// Lets go of the output sink, discarding any data not written yet
+// if the file wasn't finished, and resets the members to their
+// default state for the next PDF file.
+//---------------------------------------------------------------
+void Draw2pdf::DoEndFile() noexcept
+{
+   // The writer thread, if any, may still be writing to the sink.
+   // If the file wasn't finished, the data it hasn't written yet
+   // is discarded.
+   m_asyncSink.Stop();
+   m_output.SetSink(nullptr);
+   m_fileSink.Close();
+   m_flushPages = false;
+
+   // Drawing state left over from an unfinished page.
+   m_strokePending = false;
+   m_textOpen = false;
+   m_textBuffer.clear();
+   m_contentObjNumbers.clear();
+   m_contentLengthObjNumber = 0;
 
    // Reset members to default state for next PDF file.
    m_lineStyle = PDFLineStyle();
+   m_lineWidthSet = false;
    m_fillStyle = PDFFillStyle();
    m_textStyle = PDFTextStyle();
    m_crossRefs.clear();
@@ -232,312 +2235,1040 @@ void Draw2pdf::Close()
    m_pagesObjNumber = 0;
    m_pageObjectNumbers.clear();
    m_contentStream.clear();
+   m_encodedStream.clear();
+   m_imageStream.clear();
    m_images.clear();
+   m_pageArena.Reset();
+}
+
+//---------------------------------------------------------------
+// Sets the line style to be used for drawing any subsequent
+// graphics.
+//---------------------------------------------------------------
+void Draw2pdf::SetLineStyle(const PDFLineStyle &style)
+{
+   // The style is written to the content stream when it's next
+   // needed for drawing (see DoApplyStrokeState).
+   m_lineStyle = style;
+   m_lineWidthSet = true;
+}
+
+//---------------------------------------------------------------
+// Sets the fill style to be used for drawing any subsequent
+// graphics.
+//---------------------------------------------------------------
+void Draw2pdf::SetFillStyle(const PDFFillStyle &style)
+{
+   // The style is written to the content stream when it's next
+   // needed for drawing (see DoApplyFillColor).
+   m_fillStyle = style;
+}
+
+//---------------------------------------------------------------
+// Sets the text style to be used for drawing any subsequent
+// text strings.
+//---------------------------------------------------------------
+void Draw2pdf::SetTextStyle(const PDFTextStyle &style)
+{
+   m_textStyle = style;
+}
+
+//---------------------------------------------------------------
+// Draws a line between two points using the current line style.
+// The point coordinates are given in units of points.
+//---------------------------------------------------------------
+void Draw2pdf::DrawLine(const PDFPoint &pt1, const PDFPoint &pt2)
+{
+   // Draw the single line as a polyline.
+   const PDFPoint points[2] = { pt1, pt2 };
+   DrawPolyline(points, 2);
+}
+
+//---------------------------------------------------------------
+// Draws a polyline using the current line style.
+// The point coordinates are given in units of points.
+//---------------------------------------------------------------
+void Draw2pdf::DrawPolyline(const PDFPoint *points, size_t count)
+{
+   if (!DoBeginPolyline())
+      return;
+   for (size_t index = 0; index < count; ++index)
+      DoPathVertex(points[index]);
+   DoEndPolyline();
+}
+
+//---------------------------------------------------------------
+// Draws several polylines using the current line style.
+//---------------------------------------------------------------
+void Draw2pdf::DrawPolylines(const PDFPoint *points, size_t numPoints,
+                             const size_t *partOffsets, size_t numParts)
+{
+   DoCheckParts(numPoints, partOffsets, numParts);
+   for (size_t part = 0; part < numParts; ++part)
+   {
+      const size_t first = partOffsets[part];
+      const size_t last = (part + 1 < numParts) ? partOffsets[part + 1] : numPoints;
+      DrawPolyline(points + first, last - first);
+   }
+}
+
+//---------------------------------------------------------------
+// Starts drawing a polyline.  The polyline's vertices are then
+// given to DoPathVertex, and the polyline is finished by
+// DoEndPolyline.  Every way of drawing a polyline starts here,
+// so this is also where the content stream is split and the
+// memory budget is checked.  Returns false if the polyline isn't
+// drawn (because the line style is null), in which case the rest
+// of the steps should be skipped.
+//---------------------------------------------------------------
+bool Draw2pdf::DoBeginPolyline()
+{
+   DoCheckContentSplit();
+   DoCheckMemoryBudget();
+   if (m_lineStyle.m_pattern == PDFLineStyle::LINE_NULL)
+      return false;
+
+   DoApplyStrokeState(0);
+
+   // Output the polyline as a moveto (m) followed by a sequence
+   // of lineto (l) operations.
+   DoBeginPath();
+   return true;
+}
+
+//---------------------------------------------------------------
+// Finishes drawing a polyline that was started by
+// DoBeginPolyline.
+//---------------------------------------------------------------
+void Draw2pdf::DoEndPolyline()
+{
+   // Stroke the polyline.  If stroke batching is enabled, the
+   // stroke is deferred so that subsequent lines and polylines can
+   // be added to the same path and stroked together.
+   if (DoEndPath(false, true) > 0)
+   {
+      if (!m_batchStrokes)
+         m_content.Stroke();
+      else if (m_strokePending)
+         ++m_pageStats.back().m_strokesMerged;
+      else
+         m_strokePending = true;
+   }
+}
+
+//---------------------------------------------------------------
+// Draws a (non-compound) polygon using the current line and
+// fill styles.
+// The point coordinates are given in units of points.
+//---------------------------------------------------------------
+void Draw2pdf::DrawPolygon(const PDFPoint *points, size_t count)
+{
+   if (!DoBeginPolygon())
+      return;
+   for (size_t index = 0; index < count; ++index)
+      DoPathVertex(points[index]);
+   DoEndPolygon();
+}
+
+//---------------------------------------------------------------
+// Draws several (non-compound) polygons using the current line
+// and fill styles.
+//---------------------------------------------------------------
+void Draw2pdf::DrawPolygons(const PDFPoint *points, size_t numPoints,
+                            const size_t *partOffsets, size_t numParts)
+{
+   DoCheckParts(numPoints, partOffsets, numParts);
+   for (size_t part = 0; part < numParts; ++part)
+   {
+      const size_t first = partOffsets[part];
+      const size_t last = (part + 1 < numParts) ? partOffsets[part + 1] : numPoints;
+      DrawPolygon(points + first, last - first);
+   }
+}
+
+//---------------------------------------------------------------
+// Starts drawing a polygon.  The polygon's vertices are then
+// given to DoPathVertex, and the polygon is finished by
+// DoEndPolygon.  Like DoBeginPolyline, this also splits the
+// content stream and checks the memory budget.  Returns false if
+// the polygon isn't drawn (because the line and fill styles are
+// both null), in which case the rest of the steps should be
+// skipped.
+//---------------------------------------------------------------
+bool Draw2pdf::DoBeginPolygon()
+{
+   DoCheckContentSplit();
+   DoCheckMemoryBudget();
+   if (m_lineStyle.m_pattern == PDFLineStyle::LINE_NULL &&
+       m_fillStyle.m_pattern == PDFFillStyle::FILL_NULL)
+   {
+      return false;
+   }
+   DoFlushStroke();
+   if (m_lineStyle.m_pattern == PDFLineStyle::LINE_SOLID)
+      DoApplyStrokeState(0);
+   if (m_fillStyle.m_pattern == PDFFillStyle::FILL_SOLID)
+      DoApplyFillColor(m_fillStyle.m_color);
+
+   // Output the polygon as a moveto (m) followed by a sequence
+   // of lineto (l) operations.
+   DoBeginPath();
+   return true;
+}
+
+//---------------------------------------------------------------
+// Finishes drawing a polygon that was started by DoBeginPolygon.
+//---------------------------------------------------------------
+void Draw2pdf::DoEndPolygon()
+{
+   if (DoEndPath(true, m_lineStyle.m_pattern == PDFLineStyle::LINE_SOLID) == 0)
+      return;
+
+   // Close the polygon's path.
+   m_content.ClosePath();
+
+   // Stroke and/or fill the polygon.
+   if (m_lineStyle.m_pattern == PDFLineStyle::LINE_SOLID &&
+       m_fillStyle.m_pattern == PDFFillStyle::FILL_SOLID)
+   {
+      // Stroke and fill the path.
+      // Note that removing the '*' would change the polygon filling rule
+      // from even-odd fill to winding fill.
+      m_content.FillStrokeEvenOdd();
+   }
+   else if (m_fillStyle.m_pattern == PDFFillStyle::FILL_SOLID)
+   {
+      // Fill the path without stroking.
+      m_content.FillEvenOdd();
+   }
+   else if (m_lineStyle.m_pattern == PDFLineStyle::LINE_SOLID)
+   {
+      // Stroke the path without filling.
+      m_content.Stroke();
+   }
+}
+
+//---------------------------------------------------------------
+// Checks that the part offsets given to DrawPolylines or
+// DrawPolygons are in order and within the array of points, and
+// that the first part starts at the first point, so that every
+// point belongs to a part.  Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::DoCheckParts(size_t numPoints, const size_t *partOffsets, size_t numParts)
+{
+   if (numParts == 0 ? numPoints > 0 : partOffsets[0] != 0)
+      throw PDFException(__FILEW__, __LINE__,
+               L"Invalid part offsets for drawing multiple polylines or polygons.");
+
+   size_t previous = 0;
+   for (size_t part = 0; part < numParts; ++part)
+   {
+      if (partOffsets[part] < previous || partOffsets[part] > numPoints)
+         throw PDFException(__FILEW__, __LINE__,
+                  L"Invalid part offsets for drawing multiple polylines or polygons.");
+      previous = partOffsets[part];
+   }
+}
+
+//---------------------------------------------------------------
+// Draws a rectangle using the current line and fill styles.
+// The point coordinates are given in units of points.
+//---------------------------------------------------------------
+void Draw2pdf::DrawRectangle(const PDFBox &box)
+{
+   const PDFPoint points[4] =
+   {
+      PDFPoint(box.m_min.x, box.m_min.y),
+      PDFPoint(box.m_max.x, box.m_min.y),
+      PDFPoint(box.m_max.x, box.m_max.y),
+      PDFPoint(box.m_min.x, box.m_max.y)
+   };
+
+   DrawPolygon(points, 4);
+}
+
+//---------------------------------------------------------------
+// Draws a text string at the specified position on the page
+// (in points) using the current text style.
+//---------------------------------------------------------------
+void Draw2pdf::DrawTextString(const PDFPoint &point, const std::wstring &text)
+{
+   // TODO:  Add support for Unicode characters.  Currently assumes 8-bit US/English.
+
+   // TODO:  Doesn't currently support fonts.  Text is shown with default font.
+
+   DoBeginText();
+   DoShowText(point, text);
+}
+
+//---------------------------------------------------------------
+// Draws several text strings using the current text style.
+// The positions are given in units of points.
+//---------------------------------------------------------------
+void Draw2pdf::DrawTextStrings(const PDFTextItem *items, size_t count)
+{
+   // The text object is only set up again if a long run of strings
+   // fills the content stream, which is then split.
+   for (size_t index = 0; index < count; ++index)
+   {
+      if (index == 0 || DoContentSplitDue())
+         DoBeginText();
+      else
+         ++m_pageStats.back().m_textStringsMerged;
+      DoShowText(items[index].m_position, items[index].m_text);
+   }
+}
+
+//---------------------------------------------------------------
+// Gets the page's content stream ready for showing text strings
+// with the current text style, starting a text object (BT) if
+// one isn't already open.  Consecutive text strings are written
+// in the same text object, which is ended by DoFlushText when
+// something else is drawn.
+//---------------------------------------------------------------
+void Draw2pdf::DoBeginText()
+{
+   DoCheckContentSplit();
+   DoCheckMemoryBudget();
+   DoFlushStroke();
+   DoApplyFillColor(m_textStyle.m_color);          // Text is drawn with the fill color.
+
+   if (!m_textOpen)
+   {
+      m_content.BeginText();
+      m_textOpen = true;
+      m_textLineStart = PDFPoint(0., 0.);
+   }
+   else
+   {
+      ++m_pageStats.back().m_textStringsMerged;
+   }
+
+   // Set the font size, if it changed.
+   if (!SameNumber(m_textStyle.m_height, m_pdfState.m_fontSize, m_numberDecimals))
+   {
+      m_content.Font(1, m_textStyle.m_height);
+      m_pdfState.m_fontSize = m_textStyle.m_height;
+   }
+}
+
+//---------------------------------------------------------------
+// Shows a text string at the specified position on the page (in
+// points), in the text object started by DoBeginText.
+//---------------------------------------------------------------
+void Draw2pdf::DoShowText(const PDFPoint &point, const std::wstring &text)
+{
+   // Set the text position.  Td moves relative to the start of the
+   // previous line of text in the text object.  The moves are
+   // rounded the same way they're written, so rounding errors don't
+   // accumulate from one string to the next.
+   const double dx = DoRoundCoordinate(point.x - m_textLineStart.x);
+   const double dy = DoRoundCoordinate(point.y - m_textLineStart.y);
+   m_content.TextPosition(dx, dy);
+   m_textLineStart.x += dx;
+   m_textLineStart.y += dy;
+
+   // Show the text string.
+   EscapeText(text, m_textBuffer);
+   m_content.ShowText(m_textBuffer.data(), m_textBuffer.size());
+}
+
+//---------------------------------------------------------------
+// Draws a bitmap (raster) image at the specified position and
+// size (in points) on the page.
+//---------------------------------------------------------------
+void Draw2pdf::DrawImage(
+   const PDFImage &image,  // Image to be drawn.
+   double destX,           // Where to draw left edge of image on page, in points.
+   double destY,           // Where to draw top edge of image on page, in points.
+   double destWidth,       // Width to draw image on page, in points.
+   double destHeight       // Height to draw image on page, in points.
+   )
+{
+   if (image.m_pixels.size() < image.m_numY * image.m_stride)
+      throw PDFException(__FILEW__, __LINE__, L"Image has less pixel data than its size requires.");
+
+   DrawImage(image.m_pixels.data(), image.m_numX, image.m_numY, image.m_bpp, image.m_stride,
+      destX, destY, destWidth, destHeight);
+}
+
+//---------------------------------------------------------------
+// Draws a bitmap (raster) image at the specified position and
+// size (in points) on the page.
+//---------------------------------------------------------------
+void Draw2pdf::DrawImage(
+   const void *pixels,     // Pointer to the pixel data for the image.
+   size_t      numX,       // Width of image, in pixels.
+   size_t      numY,       // Height of image, in pixels.
+   size_t      bpp,        // Number of bits per pixel in image data.
+                           // Must be 8, 24, or 32.  8 is assumed to be grayscale.
+   size_t      stride,     // Number of bytes from the start of one scanline to
+                           // the next in the pixel data array.
+   double      destX,      // Where to draw left edge of image on page, in points.
+   double      destY,      // Where to draw top edge of image on page, in points.
+   double      destWidth,  // Width to draw image on page, in points.
+   double      destHeight  // Height to draw image on page, in points.
+   )
+{
+   // Store a copy of the image data in the page arena, to be written
+   // later (when the XObjects are written to the PDF file).  The
+   // pixel data is packed so there's no padding between scanlines.
+   // If image is 32 bits, the alpha byte of each pixel is removed.
+   QueuedImage queued;
+   queued.m_numX = numX;
+   queued.m_numY = numY;
+   queued.m_bpp = bpp;
+   queued.m_numBytes = numY * numX * (bpp == 8 ? 1 : 3);
+   unsigned char *data = static_cast<unsigned char *>(m_pageArena.allocate(queued.m_numBytes, 1));
+   queued.m_data = data;
+
+   const size_t inChannels = bpp / 8;
+   const size_t outChannels = (bpp == 8 ? 1 : 3);
+   for (size_t y = 0; y < numY; ++y)
+   {
+      const unsigned char *inpixel = static_cast<const unsigned char *>(pixels) + y * stride;
+      unsigned char *outpixel = data + y * numX * outChannels;
+      if (inChannels == outChannels)
+      {
+         memcpy(outpixel, inpixel, numX * outChannels);
+         continue;
+      }
+      for (size_t x = 0; x < numX; ++x)
+      {
+         for (size_t channel = 0; channel < outChannels; ++channel)
+            *outpixel++ = *inpixel++;
+         ++inpixel;  // Skip the alpha byte.
+      }
+   }
+
+   // Reserve a PDF object number for this image.
+   queued.m_objNum = m_objNumber++;
+   m_images.push_back(queued);
+   DoCheckContentSplit();
+   DoCheckMemoryBudget();
+
+   DoFlushStroke();
+   DoFlushText();
+   m_content.SaveState();     // Push state.
+
+   // Set the transform matrix for the image.
+   // PDF uses six coefficients, in this order:
+   //    A     scaleX
+   //    B     skewX
+   //    C     skewY
+   //    D     scaleY
+   //    E     offsetX
+   //    F     offsetY
+   //
+   // TODO:2  The image may need to be y-flipped???
+   double scaleX = destWidth;
+   double scaleY = destHeight;
+   double offsetX = destX;
+   double offsetY = destY;
+
+   m_content.Transform(scaleX, 0., 0., scaleY, offsetX, offsetY);
+
+   // Indicate which XObject will contain the data for this image.
+   m_content.DrawImage(m_images.size() - 1);
+
+   m_content.RestoreState();  // Pop state.
+}
+
+//---------------------------------------------------------------
+// Writes a previously stored image to the PDF file.
+// The index indicates which element of m_images[] is to be
+// written.
+//---------------------------------------------------------------
+void Draw2pdf::DoWriteImage(size_t index, bool compress)
+{
+   const QueuedImage &image = m_images[index];
+
+   DoBeginObject(image.m_objNum);
+   m_output.WriteText("<<\r\n");
+   m_output.WriteText("/Type /XObject\r\n");
+   m_output.WriteText("/Subtype /Image\r\n");
+   m_output.Printf("/Name /Im%zu\r\n", index);
+   m_output.Printf("/Width %zu\r\n", image.m_numX);
+   m_output.Printf("/Height %zu\r\n", image.m_numY);
+   m_output.WriteText("/BitsPerComponent 8\r\n");
+   if (image.m_bpp == 8)
+      m_output.WriteText("/ColorSpace /DeviceGray\r\n");
+   else
+      m_output.WriteText("/ColorSpace /DeviceRGB\r\n");
+
+   // Encode the image data.  Compressed data goes into the pooled
+   // stream accumulator, and ASCII-85 data into the page arena.
+   // Images smaller than the policy's minimum size aren't worth
+   // compressing.
+   if (compress && image.m_numBytes >= m_compressionPolicy.m_images.m_minSize)
+   {
+      const size_t bytesPerPixel = (image.m_bpp == 8 ? 1 : 3);
+      const bool predict = (m_predictImages && image.m_numBytes > 0);
+      m_imageStream.clear();
+      m_imageDeflater.Begin(m_imageStream);
+      if (predict)
+         DoDeflatePredicted(index, bytesPerPixel);
+      else
+         m_imageDeflater.Deflate(image.m_data, image.m_numBytes);
+      m_imageDeflater.Finish();
+      DoAddStreamStats(image.m_objNum, true, image.m_numBytes, m_imageStream.size(), &m_imageDeflater);
+      m_output.WriteText("/Filter /FlateDecode\r\n");
+      if (predict)
+      {
+         m_output.Printf("/DecodeParms << /Predictor 15 /Colors %zu /BitsPerComponent 8 /Columns %zu >>\r\n",
+                         bytesPerPixel, image.m_numX);
+      }
+      m_output.Printf("/Length %zu\r\n", m_imageStream.size());
+      m_output.WriteText(">>\r\n");
+
+      m_output.WriteText("stream\r\n");
+      m_imageStream.WriteTo(m_output);
+      m_imageStream.clear();
+   }
+   else
+   {
+      Ascii85Encoder a85(&m_pageArena);
+      const std::pmr::vector<unsigned char> &encodedData = a85.EncodeToAscii85(image.m_data, image.m_numBytes);
+      DoAddStreamStats(image.m_objNum, true, image.m_numBytes, encodedData.size(), nullptr);
+      m_output.WriteText("/Filter /ASCII85Decode\r\n");
+      m_output.Printf("/Length %zu\r\n", encodedData.size());
+      m_output.WriteText(">>\r\n");
+
+      m_output.WriteText("stream\r\n");
+      m_output.Write(encodedData.data(), encodedData.size());
+   }
+   m_output.WriteText("\r\n");
+   m_output.WriteText("endstream\r\n");
+   m_output.WriteText("endobj\r\n");
+
+   // The image's data isn't needed anymore.
+   m_images[index].m_data = nullptr;
+}
+
+//---------------------------------------------------------------
+// Compresses a previously stored image's data with the image
+// deflater, after filtering each scanline with the PNG filter that
+// leaves the smallest differences, as PNG predictor 15 expects.
+// Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::DoDeflatePredicted(size_t index, size_t bytesPerPixel)
+{
+   const QueuedImage &image = m_images[index];
+   const size_t rowBytes = image.m_numX * bytesPerPixel;
+
+   // Each filtered scanline starts with its filter type.  They're
+   // gathered into pieces of about 64KB for the deflater.  The
+   // buffer also holds a row of zeros, which is the scanline
+   // above the first, and the Sub, Up, Average and Paeth results.
+   const size_t filteredBytes = rowBytes + 1;
+   const size_t rowsPerPiece = std::max<size_t>(1, 65536 / filteredBytes);
+   std::pmr::vector<unsigned char> buffer(rowsPerPiece * filteredBytes + 5 * rowBytes, &m_pageArena);
+   unsigned char *piece = buffer.data();
+   unsigned char *candidates[5] = { nullptr };
+   for (int filter = PngSub; filter <= PngPaeth; ++filter)
+      candidates[filter] = piece + rowsPerPiece * filteredBytes + filter * rowBytes;
+   const unsigned char *prev = piece + rowsPerPiece * filteredBytes;
+
+   unsigned char *pos = piece;
+   for (size_t y = 0; y < image.m_numY; ++y)
+   {
+      // Try each filter, keeping the first with the smallest sum.
+      // The unfiltered scanline goes straight into the piece.
+      const unsigned char *row = image.m_data + y * rowBytes;
+      size_t sums[5];
+      sums[PngNone] = PngFilterScanline<PngNone>(row, prev, rowBytes, bytesPerPixel, pos + 1);
+      sums[PngSub] = PngFilterScanline<PngSub>(row, prev, rowBytes, bytesPerPixel, candidates[PngSub]);
+      sums[PngUp] = PngFilterScanline<PngUp>(row, prev, rowBytes, bytesPerPixel, candidates[PngUp]);
+      sums[PngAverage] = PngFilterScanline<PngAverage>(row, prev, rowBytes, bytesPerPixel, candidates[PngAverage]);
+      sums[PngPaeth] = PngFilterScanline<PngPaeth>(row, prev, rowBytes, bytesPerPixel, candidates[PngPaeth]);
+      int best = PngNone;
+      for (int filter = PngSub; filter <= PngPaeth; ++filter)
+      {
+         if (sums[filter] < sums[best])
+            best = filter;
+      }
+      pos[0] = static_cast<unsigned char>(best);
+      if (best != PngNone)
+         memcpy(pos + 1, candidates[best], rowBytes);
+      pos += filteredBytes;
+
+      if (pos == piece + rowsPerPiece * filteredBytes)
+      {
+         m_imageDeflater.Deflate(piece, pos - piece);
+         pos = piece;
+      }
+      prev = row;
+   }
+   if (pos != piece)
+      m_imageDeflater.Deflate(piece, pos - piece);
+}
+
+//---------------------------------------------------------------
+// Records statistics about a stream written to the PDF file.  The
+// deflater is the one that compressed the stream, or null if the
+// stream wasn't compressed.
+//---------------------------------------------------------------
+void Draw2pdf::DoAddStreamStats(size_t objNum, bool image, size_t rawBytes, size_t encodedBytes,
+                                const PDFDeflater *deflater)
+{
+   PDFStreamStats stats;
+   stats.m_objNum = objNum;
+   stats.m_image = image;
+   stats.m_compressed = (deflater != nullptr);
+   stats.m_rawBytes = rawBytes;
+   stats.m_encodedBytes = encodedBytes;
+   stats.m_seconds = (deflater != nullptr ? deflater->GetSeconds() : 0.);
+   m_streamStats.push_back(stats);
+}
+
+//---------------------------------------------------------------
+// Frees memory to try to stay within the memory budget, by
+// spilling the page's content stream data to disk and writing the
+// page's images to the PDF file early, and then giving the freed
+// memory back to the memory resource.  Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::DoReduceMemory()
+{
+   m_contentStream.Spill();
+   m_encodedStream.Spill();
+   m_blockPool.Trim();
+
+   // Images can't be written while the page's content stream object
+   // is being written to the file.
+   if (m_contentLengthObjNumber == 0)
+   {
+      for (size_t index = 0; index < m_images.size(); ++index)
+      {
+         if (m_images[index].m_data != nullptr)
+            DoWriteImage(index, m_compressImages);
+      }
+      m_pageArena.Trim();
+   }
+   ++m_budgetFlushes;
+
+   // If the memory held is still over the budget, it couldn't be
+   // reduced enough, so let it grow a bit before trying again.
+   m_memoryLimit = std::max(m_memoryBudget, m_totalMemory.GetLiveBytes() + 4 * PDFBlockPool::blockSize);
+}
+
+//---------------------------------------------------------------
+// Starts writing a new object with the given object number to the
+// PDF file, and adds the object to the cross reference table.
+// Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::DoBeginObject(size_t objNum)
+{
+   m_output.WriteText("\r\n");
+   m_crossRefs.push_back(PDFCrossRef(objNum, m_output.GetOffset()));
+   m_output.WriteUnsigned(objNum);
+   m_output.WriteText(" 0 obj\r\n");
+}
+
+//---------------------------------------------------------------
+// Writes the cross reference table to the PDF file.  The table
+// must already be sorted by object number.  Errors throw.
+//---------------------------------------------------------------
+void Draw2pdf::DoWriteCrossRefTable()
+{
+   m_output.WriteText("xref\r\n");
+   m_output.Printf("0 %zu\r\n", m_crossRefs.size() + 1); // First line indicates count of entries in table.
+   m_output.WriteText("0000000000 65535 f\r\n");       // Required dummy first entry.
+
+   // Every entry is exactly 20 bytes long, so the entries are
+   // formatted straight into the writer's buffer, many at a time.
+   static constexpr size_t entrySize = 20;
+   static constexpr size_t entriesPerBatch = PDFObjectWriter::bufferSize / entrySize / 4;
+   for (size_t first = 0; first < m_crossRefs.size(); first += entriesPerBatch)
+   {
+      size_t count = std::min(entriesPerBatch, m_crossRefs.size() - first);
+      char *entry = m_output.GetSpace(count * entrySize);
+      for (size_t index = first; index < first + count; ++index)
+      {
+         uint64_t offset = m_crossRefs[index].m_offset;
+         if (offset > maxCrossRefTableOffset)
+            throw PDFException(__FILEW__, __LINE__, L"PDF file is too large for the cross reference table.");
+         for (size_t digit = 10; digit-- > 0; offset /= 10)
+            entry[digit] = static_cast<char>('0' + offset % 10);
+         memcpy(entry + 10, " 00000 n\r\n", 10);
+         entry += entrySize;
+      }
+      m_output.Commit(count * entrySize);
+   }
 }
 
 //---------------------------------------------------------------
-// Sets the line style to be used for drawing any subsequent
-// graphics.
+// Writes a cross reference stream object to the PDF file, which
+// takes the place of the cross reference table and the trailer.
+// Unlike the table, it can hold offsets of any size.  The cross
+// reference table must already be sorted by object number.
+// Returns the offset of the stream object.  Errors throw.
 //---------------------------------------------------------------
-void Draw2pdf::SetLineStyle(const PDFLineStyle &style)
+uint64_t Draw2pdf::DoWriteCrossRefStream(int id)
 {
-   m_lineStyle = style;
-
-   // Set the line color.
-   m_contentStream.Printf("%lf %lf %lf RG\r\n",
-      m_lineStyle.m_color.m_red,
-      m_lineStyle.m_color.m_green,
-      m_lineStyle.m_color.m_blue);
-
-   // Set the line width.
-   m_contentStream.Printf("%lf w\r\n", m_lineStyle.m_width);
+   // The stream object lists itself, so it's the last entry.
+   const size_t objNum = m_objNumber++;
+   DoBeginObject(objNum);
+   const uint64_t offset = m_crossRefs.back().m_offset;
+
+   // Each entry is a type byte, then the object's offset in as few
+   // bytes as fit the biggest offset, then the generation number in
+   // two bytes (which holds the 65535 of the dummy first entry).
+   size_t offsetWidth = 1;
+   while (offsetWidth < 8 && (offset >> (8 * offsetWidth)) != 0)
+      ++offsetWidth;
+   const size_t entrySize = 1 + offsetWidth + 2;
+
+   // The entries are compressed a batch at a time, with the image
+   // deflater since no image is being written at this point.
+   // The dummy first entry is a free entry.
+   unsigned char batch[4096];
+   memset(batch, 0, entrySize);
+   batch[entrySize - 2] = batch[entrySize - 1] = 0xFF;
+   size_t batchBytes = entrySize;
+   m_imageStream.clear();
+   m_imageDeflater.Begin(m_imageStream);
+   for (const auto &xref : m_crossRefs)
+   {
+      if (batchBytes + entrySize > sizeof(batch))
+      {
+         m_imageDeflater.Deflate(batch, batchBytes);
+         batchBytes = 0;
+      }
+      unsigned char *entry = batch + batchBytes;
+      entry[0] = 1;
+      for (size_t byte = 0; byte < offsetWidth; ++byte)
+         entry[offsetWidth - byte] = static_cast<unsigned char>(xref.m_offset >> (8 * byte));
+      entry[entrySize - 2] = entry[entrySize - 1] = 0;
+      batchBytes += entrySize;
+   }
+   m_imageDeflater.Deflate(batch, batchBytes);
+   m_imageDeflater.Finish();
+
+   m_output.WriteText("<<\r\n");
+   m_output.WriteText("/Type /XRef\r\n");
+   m_output.Printf("/Size %zu /Root 1 0 R\r\n", m_crossRefs.size() + 1);
+   m_output.Printf("/W [ 1 %zu 2 ]\r\n", offsetWidth);
+   m_output.Printf("/ID[<%032d><%032d>]\r\n", id, id);
+   m_output.WriteText("/Filter /FlateDecode\r\n");
+   m_output.Printf("/Length %zu\r\n", m_imageStream.size());
+   m_output.WriteText(">>\r\n");
+   m_output.WriteText("stream\r\n");
+   m_imageStream.WriteTo(m_output);
+   m_imageStream.clear();
+   m_output.WriteText("\r\n");
+   m_output.WriteText("endstream\r\n");
+   m_output.WriteText("endobj\r\n");
+   return offset;
 }
 
 //---------------------------------------------------------------
-// Sets the fill style to be used for drawing any subsequent
-// graphics.
+// Returns statistics about the memory held by the object.
 //---------------------------------------------------------------
-void Draw2pdf::SetFillStyle(const PDFFillStyle &style)
+PDFMemoryStats Draw2pdf::GetMemoryStats() const
 {
-   m_fillStyle = style;
-
-   // Set the fill color.
-   m_contentStream.Printf("%lf %lf %lf rg\r\n",
-      m_fillStyle.m_color.m_red,
-      m_fillStyle.m_color.m_green,
-      m_fillStyle.m_color.m_blue);
+   PDFMemoryStats stats;
+   stats.m_streamBytes = m_streamMemory.GetLiveBytes();
+   stats.m_imageBytes = m_imageMemory.GetLiveBytes();
+   stats.m_compressionBytes = m_compressionMemory.GetLiveBytes();
+   stats.m_totalBytes = m_totalMemory.GetLiveBytes();
+   stats.m_peakStreamBytes = m_streamMemory.GetPeakBytes();
+   stats.m_peakImageBytes = m_imageMemory.GetPeakBytes();
+   stats.m_peakCompressionBytes = m_compressionMemory.GetPeakBytes();
+   stats.m_peakTotalBytes = m_totalMemory.GetPeakBytes();
+   stats.m_budgetFlushes = m_budgetFlushes;
+   return stats;
 }
 
 //---------------------------------------------------------------
-// Sets the text style to be used for drawing any subsequent
-// text strings.
+// Starts counting the peak numbers of the memory statistics over
+// again from the current numbers.
 //---------------------------------------------------------------
-void Draw2pdf::SetTextStyle(const PDFTextStyle &style)
+void Draw2pdf::ResetPeakMemoryStats()
 {
-   m_textStyle = style;
+   m_streamMemory.ResetPeak();
+   m_imageMemory.ResetPeak();
+   m_compressionMemory.ResetPeak();
+   m_totalMemory.ResetPeak();
 }
 
 //---------------------------------------------------------------
-// Draws a line between two points using the current line style.
-// The point coordinates are given in units of points.
+// Starts writing a new path (polyline or polygon) to the page's
+// content stream.  The path's vertices are then given to
+// DoPathVertex, and the path is finished by DoEndPath.
 //---------------------------------------------------------------
-void Draw2pdf::DrawLine(const PDFPoint &pt1, const PDFPoint &pt2)
+void Draw2pdf::DoBeginPath()
 {
-   // Draw the single line as a polyline.
-   std::vector<PDFPoint> points;
-   points.push_back(pt1);
-   points.push_back(pt2);
-   DrawPolyline(points);
+   DoFlushText();
+   m_pathInputCount = 0;
+   m_pathOutputCount = 0;
 }
 
 //---------------------------------------------------------------
-// Draws a polyline using the current line style.
-// The point coordinates are given in units of points.
+// Adds a vertex to the path being written.
+//
+// If geometry cleanup is enabled, the most recent vertex is held
+// back until the next one is known, so that it can be dropped if
+// it duplicates the previous vertex or lies on the straight line
+// between its neighbors.
 //---------------------------------------------------------------
-void Draw2pdf::DrawPolyline(const std::vector<PDFPoint> &points)
+void Draw2pdf::DoPathVertex(const PDFPoint &point)
 {
-   if (m_lineStyle.m_pattern == PDFLineStyle::LINE_NULL)
+   if (!m_cleanupGeometry)
+   {
+      DoWriteVertex(point);
       return;
+   }
 
-   // Output the polyline as a moveto (m) followed by a sequence
-   // of lineto (l) operations.
-   bool first = true;
-   for (const auto &point : points)
+   if (m_pathInputCount++ == 0)
+   {
+      m_pathHeld = point;
+      return;
+   }
+
+   // Drop vertices that would be written with the same coordinates
+   // as the previous vertex at the current number precision.
+   const double epsilon = DoCoordinateEpsilon();
+   if (fabs(point.x - m_pathHeld.x) <= epsilon && fabs(point.y - m_pathHeld.y) <= epsilon)
+   {
+      ++m_pageStats.back().m_verticesRemoved;
+      return;
+   }
+
+   // Drop the held vertex if it lies on the line between the last
+   // written vertex and the new vertex (within the tolerance), and
+   // between those two vertices rather than beyond either end.
+   if (m_pathOutputCount > 0)
    {
-      m_contentStream.Printf("%lf %lf %c\r\n", point.x, point.y, first ? 'm' : 'l');
-      first = false;
+      const double ax = m_pathHeld.x - m_pathLast.x;
+      const double ay = m_pathHeld.y - m_pathLast.y;
+      const double bx = point.x - m_pathLast.x;
+      const double by = point.y - m_pathLast.y;
+      const double lengthSquared = bx * bx + by * by;
+      const double along = ax * bx + ay * by;
+      if (along >= 0. && along <= lengthSquared &&
+          fabs(ax * by - ay * bx) <= m_collinearTolerance * sqrt(lengthSquared))
+      {
+         ++m_pageStats.back().m_verticesRemoved;
+         m_pathHeld = point;
+         return;
+      }
    }
 
-   // Stroke the polyline.
-   m_contentStream.Printf("S\r\n");
+   DoWriteVertex(m_pathHeld);
+   m_pathHeld = point;
 }
 
 //---------------------------------------------------------------
-// Draws a (non-compound) polygon using the current line and
-// fill styles.
-// The point coordinates are given in units of points.
+// Finishes the path being written.  If closed is true the path
+// is a polygon, and a final vertex that is the same as the first
+// is dropped (since closing the path draws that edge anyway).  If
+// cleanup reduced a path of two or more vertices to a single
+// point, and the path is stroked, the point is drawn as a round
+// dot so that it stays visible.
+// Returns the number of vertices written.  The caller should
+// only paint the path if this is nonzero.
 //---------------------------------------------------------------
-void Draw2pdf::DrawPolygon(const std::vector<PDFPoint> &points)
+size_t Draw2pdf::DoEndPath(bool closed, bool stroked)
 {
-   if (m_lineStyle.m_pattern == PDFLineStyle::LINE_NULL &&
-       m_fillStyle.m_pattern == PDFFillStyle::FILL_NULL)
+   if (!m_cleanupGeometry || m_pathInputCount == 0)
+      return m_pathOutputCount;
+
+   if (m_pathOutputCount == 0)
    {
-      return;
+      if (m_pathInputCount > 1 && stroked)
+         DoWriteDot(m_pathHeld);
+      return 0;
    }
 
-   // Output the polygon as a moveto (m) followed by a sequence
-   // of lineto (l) operations.
-   bool first = true;
-   for (const auto &point : points)
+   const double epsilon = DoCoordinateEpsilon();
+   if (closed && fabs(m_pathFirst.x - m_pathHeld.x) <= epsilon &&
+       fabs(m_pathFirst.y - m_pathHeld.y) <= epsilon)
    {
-      m_contentStream.Printf("%lf %lf %c\r\n", point.x, point.y, first ? 'm' : 'l');
-      first = false;
+      ++m_pageStats.back().m_verticesRemoved;
+      return m_pathOutputCount;
    }
 
-   // Close the polygon's path.
-   m_contentStream.Printf("h\r\n");
+   DoWriteVertex(m_pathHeld);
+   return m_pathOutputCount;
+}
 
-   // Stroke and/or fill the polygon.
-   if (m_lineStyle.m_pattern == PDFLineStyle::LINE_SOLID &&
-       m_fillStyle.m_pattern == PDFFillStyle::FILL_SOLID)
-   {
-      // Stroke and fill the path.
-      // Note that removing the '*' would change the polygon filling rule
-      // from even-odd fill to winding fill.
-      m_contentStream.Printf("B*\r\n");
-   }
-   else if (m_fillStyle.m_pattern == PDFFillStyle::FILL_SOLID)
+//---------------------------------------------------------------
+// Writes a vertex of the current path to the content stream.
+//---------------------------------------------------------------
+void Draw2pdf::DoWriteVertex(const PDFPoint &point)
+{
+   if (m_pathOutputCount++ == 0)
    {
-      // Fill the path without stroking.
-      m_contentStream.Printf("f*\r\n");
+      m_content.MoveTo(point.x, point.y);
+      m_pathFirst = point;
    }
-   else if (m_lineStyle.m_pattern == PDFLineStyle::LINE_SOLID)
+   else
    {
-      // Stroke the path without filling.
-      m_contentStream.Printf("S\r\n");
+      m_content.LineTo(point.x, point.y);
    }
+   m_pathLast = point;
 }
 
 //---------------------------------------------------------------
-// Draws a rectangle using the current line and fill styles.
-// The point coordinates are given in units of points.
+// Draws a zero-length line at the given point with a round line
+// cap, so that it appears as a dot the size of the line width.
 //---------------------------------------------------------------
-void Draw2pdf::DrawRectangle(const PDFBox &box)
+void Draw2pdf::DoWriteDot(const PDFPoint &point)
 {
-   std::vector<PDFPoint> points;
-   points.push_back(PDFPoint(box.m_min.x, box.m_min.y));
-   points.push_back(PDFPoint(box.m_max.x, box.m_min.y));
-   points.push_back(PDFPoint(box.m_max.x, box.m_max.y));
-   points.push_back(PDFPoint(box.m_min.x, box.m_max.y));
-
-   DrawPolygon(points);
+   DoFlushText();
+   DoFlushStroke();
+   DoApplyStrokeState(1);
+   m_content.MoveTo(point.x, point.y);
+   m_content.LineTo(point.x, point.y);
+   m_content.Stroke();
+   ++m_pageStats.back().m_dotsDrawn;
 }
 
 //---------------------------------------------------------------
-// Draws a text string at the specified position on the page
-// (in points) using the current text style.
+// Returns the coordinate (in points) rounded the same way that
+// coordinates are written to the content stream.
 //---------------------------------------------------------------
-void Draw2pdf::DrawTextString(const PDFPoint &point, const std::wstring &text)
+double Draw2pdf::DoRoundCoordinate(double value) const
 {
-   // TODO:  Add support for Unicode characters.  Currently assumes 8-bit US/English.
-
-   // TODO:  PDF doesn't like certain characters inside text strings.
-   //        Filter/re-encode any that aren't acceptable.
-
-   // TODO:  Doesn't currently support fonts.  Text is shown with default font.
+   const double unitsPerPoint = m_content.GetUnitsPerPoint();
+   if (unitsPerPoint > 0.)
+      return floor(value * unitsPerPoint + 0.5) / unitsPerPoint;
+   return RoundNumber(value, m_numberDecimals);
+}
 
-   m_contentStream.Printf("q\r\n");                                  // Push state.
-   m_contentStream.Printf("BT\r\n");
-   m_contentStream.Printf("/F1 %lf Tf\r\n", m_textStyle.m_height);   // Set font size.
-   m_contentStream.Printf("%lf %lf %lf rg\r\n",
-      m_textStyle.m_color.m_red,
-      m_textStyle.m_color.m_green,
-      m_textStyle.m_color.m_blue);
+//---------------------------------------------------------------
+// Returns the largest difference (in points) between coordinates
+// that are written to the content stream as the same number.
+//---------------------------------------------------------------
+double Draw2pdf::DoCoordinateEpsilon() const
+{
+   const double unitsPerPoint = m_content.GetUnitsPerPoint();
+   if (unitsPerPoint > 0.)
+      return 0.5 / unitsPerPoint;
+   return 0.5 / powersOfTen[m_numberDecimals];
+}
 
-   const std::string text2 = WideToNarrow(text);
+//---------------------------------------------------------------
+// Writes whichever of the current line style's color and width,
+// and the given line cap style, differ from the graphics state
+// already in effect in the page's content stream.  The width is
+// left at PDF's default until SetLineStyle is called.  Any
+// pending batched stroke is flushed first if anything is written.
+//---------------------------------------------------------------
+void Draw2pdf::DoApplyStrokeState(int lineCap)
+{
+   const PDFColor &color = m_lineStyle.m_color;
+   const bool colorChanged = !SameColor(color, m_pdfState.m_strokeColor, m_numberDecimals);
+   const bool widthChanged = m_lineWidthSet &&
+      !SameNumber(m_lineStyle.m_width, m_pdfState.m_lineWidth, m_numberDecimals);
+   const bool capChanged = (lineCap != m_pdfState.m_lineCap);
+   if (!colorChanged && !widthChanged && !capChanged)
+      return;
 
-   m_contentStream.Printf("%lf %lf Td\r\n", point.x, point.y);       // Set text position.
-   m_contentStream.Printf("(%s) Tj\r\n", text2.c_str());             // Set text string.
-   m_contentStream.Printf("ET\r\n");
-   m_contentStream.Printf("Q\r\n");                                  // Pop state.
+   DoFlushStroke();
+   if (colorChanged)
+   {
+      // Use the shorter grayscale operator when possible.
+      if (IsGray(color, m_numberDecimals))
+         m_content.StrokeGray(color.m_red);
+      else
+         m_content.StrokeColor(color);
+      m_pdfState.m_strokeColor = color;
+   }
+   if (widthChanged)
+   {
+      m_content.LineWidth(m_lineStyle.m_width);
+      m_pdfState.m_lineWidth = m_lineStyle.m_width;
+   }
+   if (capChanged)
+   {
+      m_content.LineCap(lineCap);
+      m_pdfState.m_lineCap = lineCap;
+   }
 }
 
 //---------------------------------------------------------------
-// Draws a bitmap (raster) image at the specified position and
-// size (in points) on the page.
+// Writes the given fill color to the page's content stream if it
+// differs from the fill color already in effect.  Any pending
+// batched stroke is flushed first if anything is written.
 //---------------------------------------------------------------
-void Draw2pdf::DrawImage(
-   const PDFImage &image,  // Image to be drawn.
-   double destX,           // Where to draw left edge of image on page, in points.
-   double destY,           // Where to draw top edge of image on page, in points.
-   double destWidth,       // Width to draw image on page, in points.
-   double destHeight       // Height to draw image on page, in points.
-   )
+void Draw2pdf::DoApplyFillColor(const PDFColor &color)
 {
-   // Store the image data to be written later (when the XObjects are written
-   // to the PDF file).
-   m_images.push_back(image);
-
-   // Reserve a PDF object number for this image.
-   m_images[m_images.size() - 1].m_objNum = m_objNumber++;
+   if (SameColor(color, m_pdfState.m_fillColor, m_numberDecimals))
+      return;
 
-   m_contentStream.Printf("q\r\n");    // Push state.
+   DoFlushStroke();
+   if (IsGray(color, m_numberDecimals))
+      m_content.FillGray(color.m_red);
+   else
+      m_content.FillColor(color);
+   m_pdfState.m_fillColor = color;
+}
 
-   // Set the transform matrix for the image.
-   // PDF uses six coefficients, in this order:
-   //    A     scaleX
-   //    B     skewX
-   //    C     skewY
-   //    D     scaleY
-   //    E     offsetX
-   //    F     offsetY
-   //
-   // TODO:2  The image may need to be y-flipped???
-   double scaleX = destWidth;
-   double scaleY = destHeight;
-   double offsetX = destX;
-   double offsetY = destY;
+//---------------------------------------------------------------
+// Strokes the path of any lines and polylines whose stroke was
+// deferred by stroke batching.  This must be called before
+// writing anything other than more lines and polylines to the
+// content stream, since PDF doesn't allow other operators in
+// the middle of a path.
+//---------------------------------------------------------------
+void Draw2pdf::DoFlushStroke()
+{
+   if (!m_strokePending)
+      return;
 
-   m_contentStream.Printf("%lf %lf %lf %lf %lf %lf cm\r\n",
-      scaleX, 0., 0., scaleY, offsetX, offsetY);
+   m_content.Stroke();
+   m_strokePending = false;
+}
 
-   // Indicate which XObject will contain the data for this image.
-   m_contentStream.Printf("/Im%zu Do\r\n", m_images.size() - 1);
+//---------------------------------------------------------------
+// Ends the text object of any text strings drawn since the last
+// thing that wasn't text.  This must be called before writing
+// any path or image operators to the content stream, since PDF
+// doesn't allow them inside text objects.
+//---------------------------------------------------------------
+void Draw2pdf::DoFlushText()
+{
+   if (!m_textOpen)
+      return;
 
-   m_contentStream.Printf("Q\r\n");    // Pop state.
+   m_content.EndText();
+   m_textOpen = false;
 }
 
 //---------------------------------------------------------------
-// Draws a bitmap (raster) image at the specified position and
-// size (in points) on the page.
+// Enables or disables removal of redundant vertices from lines,
+// polylines and polygons drawn after this call.
 //---------------------------------------------------------------
-void Draw2pdf::DrawImage(
-   const void *pixels,     // Pointer to the pixel data for the image.
-   size_t      numX,       // Width of image, in pixels.
-   size_t      numY,       // Height of image, in pixels.
-   size_t      bpp,        // Number of bits per pixel in image data.
-                           // Must be 8, 24, or 32.  8 is assumed to be grayscale.
-   size_t      stride,     // Number of bytes from the start of one scanline to
-                           // the next in the pixel data array.
-   double      destX,      // Where to draw left edge of image on page, in points.
-   double      destY,      // Where to draw top edge of image on page, in points.
-   double      destWidth,  // Width to draw image on page, in points.
-   double      destHeight  // Height to draw image on page, in points.
-   )
+void Draw2pdf::EnableGeometryCleanup(bool enable, double collinearTolerance)
 {
-   PDFImage image;
-   image.m_numX   = numX;
-   image.m_numY   = numY;
-   image.m_bpp    = bpp;
-   image.m_stride = stride;
-   image.m_pixels.resize(numY * stride);
-   memcpy(image.m_pixels.data(), pixels, numY * stride);
-   DrawImage(image, destX, destY, destWidth, destHeight);
+   m_cleanupGeometry = enable;
+   m_collinearTolerance = std::max(0., collinearTolerance);
 }
 
 //---------------------------------------------------------------
-// Writes a previously stored image to the PDF file.
-// The index indicates which element of m_images[] is to be
-// written.
+// Sets the number of decimal places used for numbers written to
+// the PDF file's page descriptions and drawing data.
 //---------------------------------------------------------------
-void Draw2pdf::DoWriteImage(size_t index, bool compress)
+void Draw2pdf::SetNumberPrecision(int decimals)
 {
-   const PDFImage &image = m_images[index];
-
-   fprintf(m_file, "\r\n");
-   m_crossRefs.push_back(PDFCrossRef(image.m_objNum, static_cast<size_t>(ftell(m_file))));
-   fprintf(m_file, "%zu 0 obj\r\n", image.m_objNum);
-   fprintf(m_file, "<<\r\n");
-   fprintf(m_file, "/Type /XObject\r\n");
-   fprintf(m_file, "/Subtype /Image\r\n");
-   fprintf(m_file, "/Name /Im%zu\r\n", index);
-   fprintf(m_file, "/Width %zu\r\n", image.m_numX);
-   fprintf(m_file, "/Height %zu\r\n", image.m_numY);
-   fprintf(m_file, "/BitsPerComponent 8\r\n");
-   if (image.m_bpp == 8)
-      fprintf(m_file, "/ColorSpace /DeviceGray\r\n");
-   else
-      fprintf(m_file, "/ColorSpace /DeviceRGB\r\n");
-
-   // Pack the image pixel data so there's no padding between scanlines.
-   // If image is 32 bits, the alpha byte of each pixel must also be removed.
-   std::vector<unsigned char> rawData(image.m_numY * image.m_numX * image.m_bpp / 8);
-   size_t outChannels = (image.m_bpp == 8 ? 1 : 3);
-   for (size_t y = 0; y < image.m_numY; ++y)
-   {
-      const unsigned char *inpixel = &image.m_pixels[y * image.m_stride];
-      unsigned char *outpixel = &rawData[y * image.m_numX * image.m_bpp / 8];
-      for (size_t x = 0; x < image.m_numX; ++x)
-      {
-         for (size_t channel = 0; channel < outChannels; ++channel)
-            *outpixel++ = *inpixel++;
-         if (image.m_bpp == 32)
-            ++inpixel;  // Skip the alpha byte.
-      }
-   }
-
-   // Encode the image data.
-   std::vector<unsigned char> encodedData;
-   if (compress)
-   {
-      encodedData = DeflateData(rawData.data(), rawData.size());
-      fprintf(m_file, "/Filter /FlateDecode\r\n");
-      fprintf(m_file, "/Length %zu\r\n", encodedData.size());
-   }
-   else
-   {
-      Ascii85Encoder a85;
-      encodedData = a85.EncodeToAscii85(rawData.data(), rawData.size());
-      fprintf(m_file, "/Filter /ASCII85Decode\r\n");
-      fprintf(m_file, "/Length %zu\r\n", encodedData.size());
-   }
-   fprintf(m_file, ">>\r\n");
+   m_numberDecimals = std::max(0, std::min(decimals, maxNumberDecimals));
+   m_contentStream.SetDecimals(m_numberDecimals);
+}
 
-   fprintf(m_file, "stream\r\n");
-   fwrite(encodedData.data(), 1, encodedData.size(), m_file);
-   fprintf(m_file, "\r\n");
-   fprintf(m_file, "endstream\r\n");
-   fprintf(m_file, "endobj\r\n");
+//---------------------------------------------------------------
+// Sets the number of decimal places used for numbers written to
+// the PDF file to the fewest that keep the rounding error of any
+// number within the given distance (in points).
+//---------------------------------------------------------------
+void Draw2pdf::SetNumberTolerance(double maxErrorPoints)
+{
+   // Rounding to N decimal places has a maximum error of half of
+   // the last decimal place.
+   int decimals = 0;
+   while (decimals < maxNumberDecimals && 0.5 / powersOfTen[decimals] > maxErrorPoints)
+      ++decimals;
+   SetNumberPrecision(decimals);
 }
 
 //---------------------------------------------------------------
@@ -556,87 +3287,291 @@ void Draw2pdf::NextPage()
 //---------------------------------------------------------------
 void Draw2pdf::DoBeginPage()
 {
-   size_t pageObjNumber = m_objNumber++;
-   m_pageObjectNumbers.push_back(pageObjNumber);
-   fprintf(m_file, "\r\n");
-   m_crossRefs.push_back(PDFCrossRef(pageObjNumber, static_cast<size_t>(ftell(m_file))));
-   fprintf(m_file, "%zu 0 obj\r\n", pageObjNumber);
-   fprintf(m_file, "<<\r\n");
-   fprintf(m_file, "/Type /Page\r\n");
-   fprintf(m_file, "/Parent %zu 0 R\r\n", m_pagesObjNumber);
+   // The page object is written at the end of the page, once the
+   // page's content stream objects are known, but its object number
+   // is reserved now.
+   m_pageObjNumber = m_objNumber++;
+   m_pageObjectNumbers.push_back(m_pageObjNumber);
+   m_pageStats.push_back(PDFPageStats());
+   m_contentObjNumbers.clear();
+   m_xobjectObjNumber = m_objNumber++;
+
+   DoBeginContent();
+
+   // Each page's content stream starts with PDF's default graphics
+   // state.
+   m_pdfState = PDFGraphicsState();
 
-   fprintf(m_file, "/MediaBox [ %lf %lf %lf %lf ]\r\n",
-      m_pageMinimumPoints.x, m_pageMinimumPoints.y,
-      m_pageMaximumPoints.x, m_pageMaximumPoints.y);
+   // In integer coordinate mode, scale the page to the integer
+   // units.  The default line width of 1 unit is scaled too.
+   const double unitsPerPoint = m_content.GetUnitsPerPoint();
+   if (unitsPerPoint > 0.)
+   {
+      m_content.PageScale(unitsPerPoint);
+      m_pdfState.m_lineWidth = 1. / unitsPerPoint;
+   }
+}
 
+//---------------------------------------------------------------
+// Starts a new content stream object for the page.
+//---------------------------------------------------------------
+void Draw2pdf::DoBeginContent()
+{
    m_contentsObjNumber = m_objNumber++;
-   fprintf(m_file, "/Contents %zu 0 R\r\n", m_contentsObjNumber);
+   m_contentObjNumbers.push_back(m_contentsObjNumber);
 
-   fprintf(m_file, "/Resources\r\n");
-   fprintf(m_file, "<<\r\n");
-   fprintf(m_file, "/ProcSet [ /PDF /Text /ImageB /ImageC /ImageI ]\r\n");
-   m_xobjectObjNumber = m_objNumber++;
-   fprintf(m_file, "/XObject %zu 0 R\r\n", m_xobjectObjNumber);
-   fprintf(m_file, ">>\r\n");
+   if (m_streamContent)
+   {
+      // Start the content stream object now, so that the page's
+      // content can be written to the file as it's drawn.  The
+      // content is compressed as it's drawn too, if enabled.
+      m_contentLengthObjNumber = m_objNumber++;
+      DoBeginObject(m_contentsObjNumber);
+      m_output.WriteText("<<\r\n");
+      if (m_compressContent)
+         m_output.WriteText("/Filter /FlateDecode\r\n");
+      m_output.Printf("/Length %zu 0 R\r\n", m_contentLengthObjNumber);
+      m_output.WriteText(">>\r\n");
+      m_output.WriteText("stream\r\n");
+
+      if (m_compressContent)
+      {
+         m_encodedStream.clear();
+         m_encodedStream.BeginWriteThrough(m_output);
+         m_contentDeflater.Begin(m_encodedStream);
+         m_contentStream.BeginDeflate(m_contentDeflater);
+      }
+      else
+      {
+         m_contentStream.BeginWriteThrough(m_output);
+      }
+   }
+   else if (m_compressContent && m_compressIncrementally)
+   {
+      // If enabled, the page's content is compressed as it's drawn.
+      m_encodedStream.clear();
+      m_contentDeflater.Begin(m_encodedStream);
+      m_contentStream.BeginDeflate(m_contentDeflater);
+   }
+}
 
-   fprintf(m_file, ">>\r\n");
-   fprintf(m_file, "endobj\r\n");
+//---------------------------------------------------------------
+// Finishes the current content stream object for the page, by
+// writing it, or finishing writing it if it was written while the
+// page was drawn.
+//---------------------------------------------------------------
+void Draw2pdf::DoEndContent()
+{
+   if (m_contentLengthObjNumber != 0)
+      DoEndStreamedContent();
+   else
+      DoWriteContent();
+   m_contentStream.clear();
 }
 
 //---------------------------------------------------------------
-// Performs any actions that need to be done once at the end of
-// each page of the PDF file.
+// Finishes the page's current content stream object and starts
+// a new one, so that the page's content is written as several
+// smaller streams.  The streams are joined together when the page
+// is displayed, so the graphics state carries over, but any text
+// object or pending stroke is finished first so that no object
+// is split between streams.
 //---------------------------------------------------------------
-void Draw2pdf::DoEndPage()
+void Draw2pdf::DoSplitContent()
+{
+   DoFlushStroke();
+   DoFlushText();
+   DoEndContent();
+   DoBeginContent();
+}
+
+//---------------------------------------------------------------
+// Writes the page object for the page that's ending.
+//---------------------------------------------------------------
+void Draw2pdf::DoWritePageObject()
+{
+   DoBeginObject(m_pageObjNumber);
+   m_output.WriteText("<<\r\n");
+   m_output.WriteText("/Type /Page\r\n");
+   m_output.Printf("/Parent %zu 0 R\r\n", m_pagesObjNumber);
+
+   char mediaBox[4][40];
+   mediaBox[0][FormatNumber(mediaBox[0], m_pageMinimumPoints.x, m_numberDecimals)] = '\0';
+   mediaBox[1][FormatNumber(mediaBox[1], m_pageMinimumPoints.y, m_numberDecimals)] = '\0';
+   mediaBox[2][FormatNumber(mediaBox[2], m_pageMaximumPoints.x, m_numberDecimals)] = '\0';
+   mediaBox[3][FormatNumber(mediaBox[3], m_pageMaximumPoints.y, m_numberDecimals)] = '\0';
+   m_output.Printf("/MediaBox [ %s %s %s %s ]\r\n",
+      mediaBox[0], mediaBox[1], mediaBox[2], mediaBox[3]);
+
+   // A page with several content streams lists them in an array.
+   if (m_contentObjNumbers.size() == 1)
+   {
+      m_output.Printf("/Contents %zu 0 R\r\n", m_contentObjNumbers[0]);
+   }
+   else
+   {
+      m_output.WriteText("/Contents [");
+      for (const size_t objnum : m_contentObjNumbers)
+      {
+         m_output.WriteText(" ");
+         m_output.WriteUnsigned(objnum);
+         m_output.WriteText(" 0 R");
+      }
+      m_output.WriteText(" ]\r\n");
+   }
+
+   m_output.WriteText("/Resources\r\n");
+   m_output.WriteText("<<\r\n");
+   m_output.WriteText("/ProcSet [ /PDF /Text /ImageB /ImageC /ImageI ]\r\n");
+   m_output.Printf("/XObject %zu 0 R\r\n", m_xobjectObjNumber);
+   m_output.WriteText(">>\r\n");
+
+   m_output.WriteText(">>\r\n");
+   m_output.WriteText("endobj\r\n");
+}
+
+//---------------------------------------------------------------
+// Writes the page's content stream object, for a page whose
+// content was kept until the page was finished.
+//---------------------------------------------------------------
+void Draw2pdf::DoWriteContent()
 {
-   // Write the graphics content stream.
-   fprintf(m_file, "\r\n");
-   m_crossRefs.push_back(PDFCrossRef(m_contentsObjNumber, static_cast<size_t>(ftell(m_file))));
-   fprintf(m_file, "%zu 0 obj\r\n", m_contentsObjNumber);
-   fprintf(m_file, "<<\r\n");
+   DoBeginObject(m_contentsObjNumber);
+   m_output.WriteText("<<\r\n");
+
+   // Content smaller than the policy's minimum size isn't worth
+   // compressing, unless it's too late to take that back.
+   bool compress = m_compressContent || m_contentStream.IsDeflating();
+   if (compress && m_contentStream.size() < m_compressionPolicy.m_content.m_minSize)
+   {
+      if (!m_contentStream.IsDeflating())
+      {
+         compress = false;
+      }
+      else if (m_contentStream.CancelDeflate())
+      {
+         m_encodedStream.clear();
+         compress = false;
+      }
+   }
 
-   if (!m_compressContent)
+   if (!compress)
    {
-      fprintf(m_file, "/Length %zu\r\n", m_contentStream.size());
-      fprintf(m_file, ">>\r\n");
-      fprintf(m_file, "stream\r\n");
-      fwrite(m_contentStream.data(), 1, m_contentStream.size(), m_file);
-      fprintf(m_file, "\r\n");
-      fprintf(m_file, "endstream\r\n");
-      fprintf(m_file, "endobj\r\n");
+      DoAddStreamStats(m_contentsObjNumber, false, m_contentStream.size(), m_contentStream.size(), nullptr);
+      m_output.Printf("/Length %zu\r\n", m_contentStream.size());
+      m_output.WriteText(">>\r\n");
+      m_output.WriteText("stream\r\n");
+      m_contentStream.WriteTo(m_output);
+      m_output.WriteText("\r\n");
+      m_output.WriteText("endstream\r\n");
+      m_output.WriteText("endobj\r\n");
    }
    else
    {
-      std::vector<unsigned char> encodedData;
-      encodedData = DeflateData(m_contentStream.data(), m_contentStream.size());
-      fprintf(m_file, "/Filter /FlateDecode\r\n");
-      fprintf(m_file, "/Length %zu\r\n", encodedData.size());
-      fprintf(m_file, ">>\r\n");
+      // Compress the content now, or finish compressing it if it
+      // was compressed while the page was drawn.  The compressed
+      // data may also be spilled to disk if it's very large.
+      if (m_contentStream.IsDeflating())
+      {
+         m_contentStream.EndDeflate();
+      }
+      else
+      {
+         m_encodedStream.clear();
+         m_contentDeflater.Begin(m_encodedStream);
+         m_contentStream.ForEachChunk([this](const unsigned char *data, size_t numBytes)
+         {
+            m_contentDeflater.Deflate(data, numBytes);
+         });
+         m_contentDeflater.Finish();
+      }
+      DoAddStreamStats(m_contentsObjNumber, false, m_contentStream.size(), m_encodedStream.size(), &m_contentDeflater);
+      m_output.WriteText("/Filter /FlateDecode\r\n");
+      m_output.Printf("/Length %zu\r\n", m_encodedStream.size());
+      m_output.WriteText(">>\r\n");
+
+      m_output.WriteText("stream\r\n");
+      m_encodedStream.WriteTo(m_output);
+      m_encodedStream.clear();
+      m_output.WriteText("\r\n");
+      m_output.WriteText("endstream\r\n");
+      m_output.WriteText("endobj\r\n");
+   }
+}
 
-      fprintf(m_file, "stream\r\n");
-      fwrite(encodedData.data(), 1, encodedData.size(), m_file);
-      fprintf(m_file, "\r\n");
-      fprintf(m_file, "endstream\r\n");
-      fprintf(m_file, "endobj\r\n");
+//---------------------------------------------------------------
+// Finishes writing the page's content stream object, for a page
+// whose content was written to the file as it was drawn, and
+// then writes the object holding the stream's length, which is
+// only known now.
+//---------------------------------------------------------------
+void Draw2pdf::DoEndStreamedContent()
+{
+   size_t length = 0;
+   if (m_contentStream.IsDeflating())
+   {
+      m_contentStream.EndDeflate();
+      m_encodedStream.EndWriteThrough();
+      length = m_encodedStream.size();
+      m_encodedStream.clear();
+      DoAddStreamStats(m_contentsObjNumber, false, m_contentStream.size(), length, &m_contentDeflater);
    }
+   else
+   {
+      m_contentStream.EndWriteThrough();
+      length = m_contentStream.size();
+      DoAddStreamStats(m_contentsObjNumber, false, length, length, nullptr);
+   }
+   m_output.WriteText("\r\n");
+   m_output.WriteText("endstream\r\n");
+   m_output.WriteText("endobj\r\n");
+
+   DoBeginObject(m_contentLengthObjNumber);
+   m_output.Printf("%zu\r\n", length);
+   m_output.WriteText("endobj\r\n");
+   m_contentLengthObjNumber = 0;
+}
+
+//---------------------------------------------------------------
+// Performs any actions that need to be done once at the end of
+// each page of the PDF file.
+//---------------------------------------------------------------
+void Draw2pdf::DoEndPage()
+{
+   DoFlushStroke();
+   DoFlushText();
+
+   // Write the graphics content stream, or finish writing it if it
+   // was written while the page was drawn, and then the page object
+   // that refers to it.
+   DoEndContent();
+   DoWritePageObject();
 
    // Write the object containing the XObjects table.
-   fprintf(m_file, "\r\n");
-   m_crossRefs.push_back(PDFCrossRef(m_xobjectObjNumber, static_cast<size_t>(ftell(m_file))));
-   fprintf(m_file, "%zu 0 obj\r\n", m_xobjectObjNumber);
-   fprintf(m_file, "<<\r\n");
+   DoBeginObject(m_xobjectObjNumber);
+   m_output.WriteText("<<\r\n");
    for (size_t index = 0; index < m_images.size(); ++index)
-      fprintf(m_file, "/Im%zu %zu 0 R\r\n", index, m_images[index].m_objNum);
-   fprintf(m_file, ">>\r\n");
-   fprintf(m_file, "endobj\r\n");
+      m_output.Printf("/Im%zu %zu 0 R\r\n", index, m_images[index].m_objNum);
+   m_output.WriteText(">>\r\n");
+   m_output.WriteText("endobj\r\n");
 
-   // Write the objects that contain the image pixel data.
+   // Write the objects that contain the image pixel data, except
+   // any that were written early to stay within the memory budget.
    for (size_t index = 0; index < m_images.size(); ++index)
-      DoWriteImage(index, m_compressImages);
+   {
+      if (m_images[index].m_data != nullptr)
+         DoWriteImage(index, m_compressImages);
+   }
 
-   // Prepare for next page, if any.
-   m_contentStream.clear();
+   // Prepare for next page, if any.  The page arena's memory is
+   // all reused by the next page.
    m_images.clear();
+   m_pageArena.Reset();
+   m_memoryLimit = m_memoryBudget;
+
+   // Let the reader have the page right away.
+   if (m_flushPages)
+      m_output.Flush();
 }
 
 } // End namespace draw2pdf
@@ -46,12 +46,14 @@
 //      solid lines and solid polygon fills.
 //
 //    * The size of the PDF drawing data is limited to available
-//      memory.  Drawings that are extremely large/complex can
-//      fail if memory is insufficient. 
+//      memory, unless SetContentSpillThreshold is used to move
+//      large pages' drawing data to temporary files.  Drawings
+//      that are extremely large/complex can otherwise fail if
+//      memory is insufficient.
 //
-//    * Images are compressed to save space but page drawing data
-//      is currently written in uncompressed form.  Consider
-//      compressing the page data in a future version.
+//    * Images and page drawing data are written uncompressed by
+//      default.  Use EnableImageCompression and
+//      EnableContentCompression to compress them.
 //--------------------------------------------------------------------
 
 #pragma once
@@ -59,7 +61,16 @@
 #include <string>
 #include <exception>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <memory>
+#include <memory_resource>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace draw2pdf {
 
@@ -92,6 +103,27 @@ struct PDFPoint
    PDFPoint(double xx, double yy) : x(xx), y(yy) { }
 };
 
+//--------------------------------------------------------------------
+// Traits class that tells Draw2pdf's templated drawing functions how
+// to get the coordinates (in points) of a point type, so that the
+// application's own point types can be drawn without first copying
+// them into PDFPoints.  The default works with any type that has
+// numeric members named x and y (double, float, int, etc.).  For
+// other point types, specialize this in the draw2pdf namespace:
+//
+//    template <> struct PDFPointTraits<MyPoint>
+//    {
+//       static double X(const MyPoint &pt) { return pt.m_east; }
+//       static double Y(const MyPoint &pt) { return pt.m_north; }
+//    };
+//--------------------------------------------------------------------
+template <typename PointType>
+struct PDFPointTraits
+{
+   static double X(const PointType &pt) { return static_cast<double>(pt.x); }
+   static double Y(const PointType &pt) { return static_cast<double>(pt.y); }
+};
+
 //--------------------------------------------------------------------
 // Container to describe a rectangle.
 //--------------------------------------------------------------------
@@ -210,6 +242,36 @@ struct PDFTextStyle
       m_height(height), m_color(color) { }
 };
 
+//--------------------------------------------------------------------
+// Container to describe the graphics state parameters that draw2pdf
+// sets in a page's content stream.  The default values are PDF's
+// initial graphics state at the start of each page.
+//--------------------------------------------------------------------
+struct PDFGraphicsState
+{
+   PDFColor m_strokeColor;       // Stroking color, set with RG or G.
+   PDFColor m_fillColor;         // Non-stroking color, set with rg or g.
+   double   m_lineWidth = 1.;    // Line width, set with w.
+   int      m_lineCap = 0;       // Line cap style, set with J.
+   double   m_fontSize = 0.;     // Text font size, set with Tf (0 if not set yet).
+
+   PDFGraphicsState() = default;
+};
+
+//--------------------------------------------------------------------
+// Container to describe one text string to be drawn by
+// Draw2pdf::DrawTextStrings.
+//--------------------------------------------------------------------
+struct PDFTextItem
+{
+   PDFPoint       m_position;    // Where to draw the text, in points.
+   std::wstring   m_text;        // The text string to draw.
+
+   PDFTextItem() = default;
+   PDFTextItem(const PDFPoint &position, const std::wstring &text) :
+      m_position(position), m_text(text) { }
+};
+
 //--------------------------------------------------------------------
 // Container to describe one cross reference in the PDF file.
 // A list of these is used for generating the cross references table
@@ -218,10 +280,10 @@ struct PDFTextStyle
 struct PDFCrossRef
 {
    size_t m_objnum = 0;    // The object number of the object to which this refers.
-   size_t m_offset = 0;    // The offset of the object in the PDF file.
+   uint64_t m_offset = 0;  // The offset of the object in the PDF file.
 
    PDFCrossRef() = default;
-   PDFCrossRef(size_t objnum, size_t offset) : m_objnum(objnum), m_offset(offset) { }
+   PDFCrossRef(size_t objnum, uint64_t offset) : m_objnum(objnum), m_offset(offset) { }
 };
 
 //--------------------------------------------------------------------
@@ -243,18 +305,708 @@ struct PDFImage
    PDFImage() = default;
 };
 
+//--------------------------------------------------------------------
+// Container for statistics about the memory held by a Draw2pdf
+// object, in bytes, by category.  The peak numbers are the most held
+// at once since the object was created or its peak numbers were
+// reset.
+//--------------------------------------------------------------------
+struct PDFMemoryStats
+{
+   size_t   m_streamBytes = 0;      // Stream data buffers (page content, compressed data).
+   size_t   m_imageBytes = 0;       // Images waiting to be written, and their encoding buffers.
+   size_t   m_compressionBytes = 0; // ZLIB compression state.
+   size_t   m_totalBytes = 0;       // All of the above, plus other bookkeeping.
+   size_t   m_peakStreamBytes = 0;
+   size_t   m_peakImageBytes = 0;
+   size_t   m_peakCompressionBytes = 0;
+   size_t   m_peakTotalBytes = 0;
+   size_t   m_budgetFlushes = 0;    // Times memory was reduced to stay within the memory budget.
+};
+
+//--------------------------------------------------------------------
+// Container for statistics about the drawing on one page of the
+// PDF file.
+//--------------------------------------------------------------------
+struct PDFPageStats
+{
+   size_t   m_verticesRemoved = 0;  // Redundant vertices dropped by geometry cleanup.
+   size_t   m_dotsDrawn = 0;        // Zero-length lines drawn as round dots.
+   size_t   m_strokesMerged = 0;    // Lines/polylines stroked together with a previous one.
+   size_t   m_textStringsMerged = 0;// Text strings drawn in the same text object as a previous one.
+
+   PDFPageStats() = default;
+};
+
+//--------------------------------------------------------------------
+// Strategy that ZLIB's deflate compression uses (see ZLIB's
+// deflateInit2).  Filtered suits data like image pixels, which has
+// many small, somewhat random values, and HuffmanOnly doesn't look
+// for repeated strings at all, which is fastest.
+//--------------------------------------------------------------------
+enum class PDFCompressionStrategy
+{
+   Default,
+   Filtered,
+   HuffmanOnly
+};
+
+//--------------------------------------------------------------------
+// Settings for compressing one type of stream.  The defaults are
+// the same as ZLIB's defaults.
+//--------------------------------------------------------------------
+struct PDFCompressionSettings
+{
+   int                     m_level = -1;        // 0 (none) to 9 (best), or -1 for ZLIB's default (6).
+   int                     m_windowBits = 15;   // 9 to 15; the window is 2^windowBits bytes.
+   int                     m_memLevel = 8;      // 1 (least memory) to 9 (fastest).
+   PDFCompressionStrategy  m_strategy = PDFCompressionStrategy::Default;
+   size_t                  m_minSize = 0;       // Streams smaller than this many bytes aren't compressed.
+
+   PDFCompressionSettings() = default;
+   PDFCompressionSettings(int level, PDFCompressionStrategy strategy = PDFCompressionStrategy::Default) :
+      m_level(level), m_strategy(strategy) { }
+};
+
+//--------------------------------------------------------------------
+// How each type of stream in a PDF file is compressed, when
+// compression of that type of stream is enabled.
+//--------------------------------------------------------------------
+struct PDFCompressionPolicy
+{
+   PDFCompressionSettings m_content;   // Page content streams.
+   PDFCompressionSettings m_images;    // Image pixel data.
+
+   PDFCompressionPolicy() = default;
+   PDFCompressionPolicy(const PDFCompressionSettings &content, const PDFCompressionSettings &images) :
+      m_content(content), m_images(images) { }
+};
+
+//--------------------------------------------------------------------
+// Container for statistics about one stream written to a PDF file.
+//--------------------------------------------------------------------
+struct PDFStreamStats
+{
+   size_t   m_objNum = 0;        // Object number of the stream.
+   bool     m_image = false;     // True for an image, false for page content.
+   bool     m_compressed = false;// True if the stream was compressed.
+   size_t   m_rawBytes = 0;      // Size of the data before it was encoded.
+   size_t   m_encodedBytes = 0;  // Size of the data in the PDF file.
+   double   m_seconds = 0.;      // Time spent compressing the data.
+
+   PDFStreamStats() = default;
+
+   // Returns the size of the data in the PDF file relative to its
+   // size before it was encoded.
+   double GetRatio() const
+   {
+      return (m_rawBytes == 0 ? 1. : static_cast<double>(m_encodedBytes) / static_cast<double>(m_rawBytes));
+   }
+};
+
+//--------------------------------------------------------------------
+// Memory resource that passes allocations on to an upstream memory
+// resource, keeping count of the number of bytes allocated now and
+// the most allocated at once.
+//--------------------------------------------------------------------
+class PDFMemoryTracker : public std::pmr::memory_resource
+{
+public:
+   explicit PDFMemoryTracker(std::pmr::memory_resource *upstream = std::pmr::get_default_resource()) :
+      m_upstream(upstream) { }
+   PDFMemoryTracker(const PDFMemoryTracker &copy) = delete;
+   ~PDFMemoryTracker() = default;
+
+   // Returns the number of bytes allocated now.
+   size_t GetLiveBytes() const { return m_liveBytes; }
+
+   // Returns the most bytes allocated at once.
+   size_t GetPeakBytes() const { return m_peakBytes; }
+
+   // Starts counting the most bytes allocated at once over again.
+   void ResetPeak() { m_peakBytes = m_liveBytes; }
+
+private:
+   void *do_allocate(size_t numBytes, size_t alignment) override
+   {
+      void *memory = m_upstream->allocate(numBytes, alignment);
+      m_liveBytes += numBytes;
+      m_peakBytes = std::max(m_peakBytes, m_liveBytes);
+      return memory;
+   }
+
+   void do_deallocate(void *memory, size_t numBytes, size_t alignment) override
+   {
+      m_upstream->deallocate(memory, numBytes, alignment);
+      m_liveBytes -= numBytes;
+   }
+
+   bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+   std::pmr::memory_resource *m_upstream;
+   size_t m_liveBytes = 0;
+   size_t m_peakBytes = 0;
+};
+
+//--------------------------------------------------------------------
+// Interface for where the data of a PDF file is written.  Draw2pdf
+// writes the PDF file's data to a sink in order, from start to end.
+//--------------------------------------------------------------------
+class PDFOutputSink
+{
+public:
+   PDFOutputSink() = default;
+   PDFOutputSink(const PDFOutputSink &copy) = delete;
+   virtual ~PDFOutputSink() = default;
+
+   // Writes the given bytes of data.  Errors throw.
+   virtual void Write(const void *data, size_t numBytes) = 0;
+
+   // Called after the last of the PDF file's data has been written.
+   // Errors throw.
+   virtual void Finish() { }
+};
+
+//--------------------------------------------------------------------
+// Output sink that writes the data to a file.
+//--------------------------------------------------------------------
+class PDFFileSink : public PDFOutputSink
+{
+public:
+   PDFFileSink() = default;
+   ~PDFFileSink() { Close(); }
+
+   // Creates the given file for writing.  Errors throw.
+   void Open(const std::wstring &filename);
+
+   // Closes the file, if it's open.
+   void Close();
+
+   void Write(const void *data, size_t numBytes) override;
+   void Finish() override;
+
+private:
+   bool DoAllocate(size_t numBytes);
+   bool DoTrim();
+
+   FILE * m_file = nullptr;
+
+   // Number of bytes written to the file, the number of bytes of
+   // disk space that have been set aside for the file so far, and
+   // whether to keep setting disk space aside.
+   size_t m_written = 0;
+   size_t m_preallocated = 0;
+   bool   m_preallocate = true;
+};
+
+//--------------------------------------------------------------------
+// Output sink that keeps the data in memory, in a buffer that grows
+// as needed.
+//--------------------------------------------------------------------
+class PDFMemorySink : public PDFOutputSink
+{
+public:
+   PDFMemorySink() = default;
+
+   void Write(const void *data, size_t numBytes) override
+   {
+      const unsigned char *ucdata = reinterpret_cast<const unsigned char *>(data);
+      m_data.insert(m_data.end(), ucdata, ucdata + numBytes);
+   }
+
+   // Returns the data written so far.
+   const std::vector<unsigned char> &GetData() const { return m_data; }
+
+   // Moves the data written so far out of the sink, leaving it empty.
+   std::vector<unsigned char> TakeData() { return std::move(m_data); }
+
+   // Discards the data written so far.
+   void clear() { m_data.clear(); }
+
+private:
+   std::vector<unsigned char> m_data;
+};
+
+//--------------------------------------------------------------------
+// Output sink that passes the data to functions given by the user.
+//--------------------------------------------------------------------
+class PDFCallbackSink : public PDFOutputSink
+{
+public:
+   // The write function is called with each piece of data, in order.
+   // The finish function, if any, is called after the last piece.
+   explicit PDFCallbackSink(std::function<void(const void *data, size_t numBytes)> write,
+                            std::function<void()> finish = nullptr) :
+      m_write(std::move(write)), m_finish(std::move(finish)) { }
+
+   void Write(const void *data, size_t numBytes) override { m_write(data, numBytes); }
+   void Finish() override { if (m_finish) m_finish(); }
+
+private:
+   std::function<void(const void *data, size_t numBytes)> m_write;
+   std::function<void()> m_finish;
+};
+
+//--------------------------------------------------------------------
+// Writer that the objects of a PDF file are written with.  The data
+// is gathered in one large buffer and passed on to a sink in big
+// pieces, and the bytes written are counted, so that the offset of
+// each object in the PDF file is known without asking the sink.
+// Integers are formatted by hand, since most of what's written is
+// keywords and object numbers.
+//--------------------------------------------------------------------
+class PDFObjectWriter : public PDFOutputSink
+{
+public:
+   static constexpr size_t bufferSize = 256 * 1024;
+
+   // The buffer's memory comes from the given memory resource.
+   explicit PDFObjectWriter(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+      m_resource(resource) { }
+   ~PDFObjectWriter() { DoFreeBuffer(); }
+
+   //---------------------------------------------------------------
+   // Sets the sink that the data is passed on to, and starts
+   // counting from zero.  Any data still in the buffer is
+   // discarded.  The buffer is freed when the sink is set to
+   // nullptr.  Errors throw.
+   //---------------------------------------------------------------
+   void SetSink(PDFOutputSink *sink);
+
+   // Returns the sink that the data is passed on to, if any.
+   PDFOutputSink *GetSink() const { return m_sink; }
+
+   // Returns the number of bytes written so far.  This is 64 bits
+   // even in 32-bit builds, since PDF files can be bigger than 4GB.
+   uint64_t GetOffset() const { return m_offset; }
+
+   // Writes the given bytes of data.  Errors throw.
+   void Write(const void *data, size_t numBytes) override
+   {
+      if (numBytes <= static_cast<size_t>(m_end - m_pos))
+      {
+         memcpy(m_pos, data, numBytes);
+         m_pos += numBytes;
+         m_offset += numBytes;
+      }
+      else
+         DoWriteLarge(data, numBytes);
+   }
+
+   // Writes the given text.  Errors throw.
+   void WriteText(const char *text) { Write(text, strlen(text)); }
+
+   // Writes the given unsigned integer as decimal text.  Errors throw.
+   void WriteUnsigned(size_t value);
+
+   // Writes formatted text, which must fit in a line of text.
+   // Formatting is the same as printf in the runtime library.
+   // Errors throw.
+   void Printf(const char *format, ...);
+
+   //---------------------------------------------------------------
+   // Returns space in the buffer for at least the given number of
+   // bytes, which must not be more than the buffer's size.  After
+   // filling in the space, call Commit with the number of bytes
+   // that were filled in.  Errors throw.
+   //---------------------------------------------------------------
+   char *GetSpace(size_t numBytes)
+   {
+      if (numBytes > static_cast<size_t>(m_end - m_pos))
+         Flush();
+      return m_pos;
+   }
+
+   // Commits bytes filled in to the space returned by GetSpace.
+   void Commit(size_t numBytes)
+   {
+      m_pos += numBytes;
+      m_offset += numBytes;
+   }
+
+   // Passes the data in the buffer on to the sink.  Errors throw.
+   void Flush();
+
+   // Passes the rest of the data on to the sink and finishes the
+   // sink.  Errors throw.
+   void Finish() override;
+
+private:
+   void DoWriteLarge(const void *data, size_t numBytes);
+   void DoFreeBuffer() noexcept;
+
+   std::pmr::memory_resource *   m_resource;
+   PDFOutputSink *               m_sink = nullptr;
+
+   // Buffer, and the part of it that hasn't been filled in yet.
+   char *   m_buffer = nullptr;
+   char *   m_pos = nullptr;
+   char *   m_end = nullptr;
+
+   uint64_t m_offset = 0;
+};
+
+//--------------------------------------------------------------------
+// Output sink that passes the data on to another sink from a
+// separate writer thread, so that the thread writing the PDF file
+// doesn't have to wait for the disk.  The data is copied to buffers
+// that are handed to the writer thread through a bounded queue; a
+// write only waits if all of the buffers are still queued.  Errors
+// from the other sink are thrown by a later Write or by Finish.
+//--------------------------------------------------------------------
+class PDFAsyncSink : public PDFOutputSink
+{
+public:
+   static constexpr size_t bufferSize = 256 * 1024;
+   static constexpr size_t defaultQueueDepth = 4;
+
+   // The buffers' memory comes from the given memory resource.
+   explicit PDFAsyncSink(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+      m_resource(resource), m_freeBuffers(resource), m_queue(resource) { }
+   ~PDFAsyncSink() { Stop(); }
+
+   //---------------------------------------------------------------
+   // Starts the writer thread, which passes the data on to the
+   // given sink.  Up to the given number of buffers of data can be
+   // queued for the writer thread.  Errors throw.
+   //---------------------------------------------------------------
+   void Start(PDFOutputSink &sink, size_t queueDepth = defaultQueueDepth);
+
+   // Stops the writer thread without finishing the other sink.
+   // Data that hasn't been written yet is discarded.
+   void Stop() noexcept;
+
+   // Returns true if the writer thread is running.
+   bool IsStarted() const { return m_thread.joinable(); }
+
+   void Write(const void *data, size_t numBytes) override;
+
+   // Waits for all of the data to be written, stops the writer
+   // thread, and finishes the other sink.  Errors throw.
+   void Finish() override;
+
+private:
+   struct Buffer
+   {
+      char *   m_data;
+      size_t   m_numBytes;
+   };
+
+   void DoHandOff();
+   void DoQueue();
+   void DoWriterThread();
+   void DoFreeBuffers() noexcept;
+
+   std::pmr::memory_resource *   m_resource;
+   PDFOutputSink *               m_sink = nullptr;
+   std::thread                   m_thread;
+
+   // Buffer being filled in.
+   char *   m_current = nullptr;
+   size_t   m_currentBytes = 0;
+
+   // Everything below the mutex is shared with the writer thread.
+   // The free buffer list and the queue (a ring of buffers) have
+   // room for all of the buffers, so that the writer thread never
+   // allocates memory; the memory resource isn't thread-safe.
+   std::mutex                    m_mutex;
+   std::condition_variable       m_changed;
+   std::pmr::vector<char *>      m_freeBuffers;
+   std::pmr::vector<Buffer>      m_queue;
+   size_t                        m_queueFirst = 0;
+   size_t                        m_queueCount = 0;
+   size_t                        m_numBuffers = 0;
+   bool                          m_finishing = false;
+   bool                          m_stopping = false;
+   std::exception_ptr            m_error;
+};
+
+//--------------------------------------------------------------------
+// Output sink that keeps the data until a reader pulls it out with
+// Read, usually from another thread, e.g. to send the PDF file to a
+// network client at the client's pace.  Once the data held reaches
+// the high-water mark, a blocking sink makes the writer wait until
+// the reader catches up, and a non-blocking sink keeps taking data
+// but reports that it's full, so the writer can stop and let the
+// reader catch up.  Either way the data held stays bounded.
+//--------------------------------------------------------------------
+class PDFPullSink : public PDFOutputSink
+{
+public:
+   static constexpr size_t defaultHighWaterMark = 1024 * 1024;
+
+   // The data's memory comes from the given memory resource.
+   explicit PDFPullSink(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+      m_data(resource) { }
+
+   // Sets the most data to hold before the writer waits (if
+   // blocking) or the sink reports that it's full.
+   void SetHighWaterMark(size_t numBytes, bool blocking);
+
+   // Discards any data held and gets ready for a new PDF file.
+   void Reset();
+
+   //---------------------------------------------------------------
+   // Copies up to the given number of bytes of the next data to the
+   // given buffer, and returns the number of bytes copied.  If the
+   // sink is blocking, waits until there is some data; otherwise
+   // returns 0 if there's no data yet.  Returns 0 at the end of the
+   // PDF file (see IsComplete).
+   //---------------------------------------------------------------
+   size_t Read(void *buffer, size_t maxBytes);
+
+   // Returns true if the data held is at the high-water mark.
+   bool IsFull() const;
+
+   // Returns true if the PDF file is finished and all of its data
+   // has been read.
+   bool IsComplete() const;
+
+   // Makes any further writes throw (waking a waiting writer), e.g.
+   // after the reader's client went away.  Lasts until Reset.
+   void Cancel();
+
+   void Write(const void *data, size_t numBytes) override;
+   void Finish() override;
+
+private:
+   size_t DoHeldBytes() const { return m_data.size() - m_readPos; }
+
+   mutable std::mutex               m_mutex;
+   std::condition_variable          m_changed;
+   std::pmr::vector<unsigned char>  m_data;
+   size_t                           m_readPos = 0;
+   size_t                           m_highWaterMark = defaultHighWaterMark;
+   bool                             m_blocking = true;
+   bool                             m_finished = false;
+   bool                             m_cancelled = false;
+};
+
+class PDFStreamAccumulator;
+
+//--------------------------------------------------------------------
+// Class to compress data with ZLIB's deflate compression a piece at
+// a time, adding the compressed data to a stream accumulator.  The
+// ZLIB stream is kept and reused for each new stream of data.
+//--------------------------------------------------------------------
+class PDFDeflater
+{
+public:
+   // ZLIB's memory comes from the given memory resource.
+   explicit PDFDeflater(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+      m_resource(resource) { }
+   PDFDeflater(const PDFDeflater &copy) = delete;
+   ~PDFDeflater();
+
+   // Starts a new stream of compressed data, which is added to the
+   // given stream accumulator.  Errors throw.
+   void Begin(PDFStreamAccumulator &output);
+
+   // Compresses the given bytes of data.  Errors throw.
+   void Deflate(const void *data, size_t numBytes);
+
+   // Compresses any remaining data and ends the stream of
+   // compressed data.  Errors throw.
+   void Finish();
+
+   // Returns true between Begin and Finish.
+   bool IsActive() const { return m_output != nullptr; }
+
+   //---------------------------------------------------------------
+   // Sets the number of threads that compress the data, for data
+   // bigger than a block (128KB).  With more than one thread, the
+   // data is split into blocks that are compressed at the same
+   // time, each using the end of the previous block as a preset
+   // dictionary, and the pieces are joined into one ZLIB stream.
+   // Zero uses one thread per processor core.  The default is one,
+   // which compresses on the calling thread.  Takes effect at the
+   // next Begin.
+   //---------------------------------------------------------------
+   void SetThreadCount(size_t numThreads) { m_numThreads = numThreads; }
+
+   // Sets the level, window size, memory level and strategy that
+   // the data is compressed with.  The minimum size isn't used
+   // here.  Takes effect at the next Begin.
+   void SetSettings(const PDFCompressionSettings &settings) { m_settings = settings; }
+
+   // Returns the number of bytes of data given to the deflater, and
+   // the time spent compressing them, since Begin.
+   size_t GetInputBytes() const { return m_inputBytes; }
+   double GetSeconds() const { return m_seconds; }
+
+   // Abandons the stream of compressed data, if no data has been
+   // given to the deflater since Begin.  Errors throw.
+   void Cancel();
+
+   static constexpr size_t parallelBlockSize = 128 * 1024;
+
+private:
+   void DoDeflate(const void *data, size_t numBytes, int flush);
+   void DoFinish();
+   void DoSubmitBlock(bool last);
+   void DoCollectBlock();
+   void DoStopParallel() noexcept;
+
+   // The ZLIB stream and its output buffer, which are defined in
+   // the implementation file so ZLIB's header isn't needed here.
+   struct ZlibStream;
+   std::pmr::memory_resource *   m_resource;
+   ZlibStream *                  m_zlib = nullptr;
+
+   // Settings to compress with, and those the ZLIB stream has.
+   PDFCompressionSettings        m_settings;
+   PDFCompressionSettings        m_zlibSettings;
+
+   // Statistics about the current stream.
+   size_t                        m_inputBytes = 0;
+   double                        m_seconds = 0.;
+
+   // Worker threads and blocks for compressing in parallel, also
+   // defined in the implementation file.
+   struct Parallel;
+   Parallel *  m_parallel = nullptr;
+   size_t      m_numThreads = 1;
+
+   // Where the compressed data goes, or nullptr if not active.
+   PDFStreamAccumulator *m_output = nullptr;
+};
+
+//--------------------------------------------------------------------
+// Class to manage a pool of fixed-size memory blocks for stream
+// accumulators.  The blocks come from a std::pmr::memory_resource.
+// Blocks given back to the pool are kept for reuse by later pages
+// and documents, instead of being freed and then allocated again.
+//--------------------------------------------------------------------
+class PDFBlockPool
+{
+public:
+   explicit PDFBlockPool(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+      m_resource(resource), m_freeBlocks(resource) { }
+   PDFBlockPool(const PDFBlockPool &copy) = delete;
+   ~PDFBlockPool() { Trim(); }
+
+   // Size of each block in bytes.
+   static constexpr size_t blockSize = 64 * 1024;
+
+   // Returns a block of blockSize bytes, reusing a block from the
+   // pool if there is one.  The block's contents are undefined.
+   // Errors throw.
+   unsigned char *Acquire()
+   {
+      if (m_freeBlocks.empty())
+         return static_cast<unsigned char *>(m_resource->allocate(blockSize));
+      unsigned char *block = m_freeBlocks.back();
+      m_freeBlocks.pop_back();
+      return block;
+   }
+
+   // Gives a block back to the pool for reuse.
+   void Release(unsigned char *block) noexcept
+   {
+      try
+      {
+         m_freeBlocks.push_back(block);
+      }
+      catch (...)
+      {
+         m_resource->deallocate(block, blockSize);
+      }
+   }
+
+   // Returns the number of blocks waiting in the pool for reuse.
+   size_t GetFreeBlockCount() const { return m_freeBlocks.size(); }
+
+   // Frees the memory of the blocks waiting in the pool.
+   void Trim()
+   {
+      for (unsigned char *block : m_freeBlocks)
+         m_resource->deallocate(block, blockSize);
+      m_freeBlocks.clear();
+   }
+
+   // Returns the memory resource that the blocks come from.
+   std::pmr::memory_resource *GetResource() const { return m_resource; }
+
+private:
+   std::pmr::memory_resource *         m_resource;
+   std::pmr::vector<unsigned char *>   m_freeBlocks;
+};
+
+//--------------------------------------------------------------------
+// Memory resource for short-lived data, such as a page's images.
+// Memory is handed out from large chunks and is never freed one
+// allocation at a time; instead Reset makes all of the memory
+// available again at once.  The chunks are kept for reuse rather
+// than given back to the upstream memory resource, so an arena that
+// is reset after each page stops allocating once it has grown to fit
+// the biggest page.
+//--------------------------------------------------------------------
+class PDFPageArena : public std::pmr::memory_resource
+{
+public:
+   explicit PDFPageArena(std::pmr::memory_resource *upstream = std::pmr::get_default_resource()) :
+      m_upstream(upstream) { }
+   PDFPageArena(const PDFPageArena &copy) = delete;
+   ~PDFPageArena() { Trim(); }
+
+   // Size of the arena's chunks, except for chunks made for larger
+   // allocations.
+   static constexpr size_t chunkSize = 64 * 1024;
+
+   // Makes all of the arena's memory available for reuse.  Memory
+   // allocated from the arena before must no longer be used.
+   void Reset();
+
+   // Gives all of the arena's chunks back to the upstream memory
+   // resource.  Memory allocated from the arena before must no
+   // longer be used.
+   void Trim();
+
+   // Returns the total size in bytes of the arena's chunks.
+   size_t GetCapacity() const { return m_capacity; }
+
+private:
+   // Header at the start of each chunk.
+   struct Chunk
+   {
+      Chunk *  m_next;
+      size_t   m_size;
+   };
+
+   void *do_allocate(size_t numBytes, size_t alignment) override;
+   void do_deallocate(void *, size_t, size_t) override { }
+   bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+   std::pmr::memory_resource *m_upstream;
+
+   // List of chunks, the chunk that memory is currently allocated
+   // from, and the number of bytes used in that chunk (including
+   // its header).
+   Chunk *  m_firstChunk = nullptr;
+   Chunk *  m_lastChunk = nullptr;
+   Chunk *  m_currentChunk = nullptr;
+   size_t   m_used = 0;
+   size_t   m_capacity = 0;
+};
+
 //--------------------------------------------------------------------
 // Class to manage accumulating text or binary data into a buffer
-// for later writing.  Currently the data is stored in memory.
-// TODO:  Add an option to write the temporary stream data to disk
-// instead of memory for extremely large PDF files.
+// for later writing.  The data is stored in memory as a list of
+// fixed-size blocks from a block pool, so the data never has to be
+// reallocated and copied as it grows.  If a spill threshold is set
+// and the data grows beyond it, the data is moved to a temporary
+// file on disk.  This keeps the memory used by extremely large PDF
+// pages bounded.
 //--------------------------------------------------------------------
 class PDFStreamAccumulator
 {
 public:
-   PDFStreamAccumulator() = default;
+   // The accumulator takes its blocks from the given pool, which
+   // must outlive it, or from a pool of its own if none is given.
+   explicit PDFStreamAccumulator(PDFBlockPool *pool = nullptr) :
+      m_pool(pool != nullptr ? pool : &m_ownPool), m_blocks(m_pool->GetResource()) { }
    PDFStreamAccumulator(const PDFStreamAccumulator &copy) = delete;
-   ~PDFStreamAccumulator() = default;
+   ~PDFStreamAccumulator() { clear(); }
 
    // Adds bytes of binary data to the stream.
    void AddData(const void *data, size_t numBytes);
@@ -267,18 +1019,317 @@ public:
    // Formatting is the same as printf in the runtime library.
    void Printf(const char *format, ...);
 
+   // Adds a number to the stream as fixed-point text followed by a
+   // space, e.g. "220.84 ".  The number is rounded to the stream's
+   // number of decimal places, and trailing zeros are trimmed.
+   // The formatting does not depend on the C runtime's locale and
+   // does not allocate memory, so this is much faster than Printf
+   // for content stream operands.
+   void AddNumber(double value);
+
+   // Adds an integer to the stream followed by a space.
+   void AddInteger(long long value);
+
+   // Adds a content stream operator (e.g. "m", "RG", "B*") to the
+   // stream, followed by a line break.
+   void AddOperator(const char *op);
+
+   // Formats a number the same way as AddNumber, but into the given
+   // buffer (without the trailing space) instead of the stream.  The
+   // buffer must have room for maxNumberLength characters.
+   // Returns the number of characters written.
+   size_t FormatNumber(char *buffer, double value) const;
+
+   // Formats an integer into the given buffer.  The buffer must have
+   // room for maxNumberLength characters.
+   // Returns the number of characters written.
+   static size_t FormatInteger(char *buffer, long long value);
+
+   // Formats a number like FormatNumber, but with as many decimal
+   // places as the formatter supports, regardless of the stream's
+   // number of decimal places.
+   static size_t FormatExactNumber(char *buffer, double value);
+
+   // Maximum number of characters written by FormatNumber.
+   static constexpr size_t maxNumberLength = 32;
+
    // Returns the number of bytes in the stream so far.
-   size_t size() const { return m_data.size(); }
+   size_t size() const
+   {
+      return m_passedOnBytes + m_spilledBytes + m_blocks.size() * PDFBlockPool::blockSize -
+         static_cast<size_t>(m_writeEnd - m_writePos);
+   }
 
-   // Returns a pointer to the stream data accumulated so far.
-   const unsigned char *data() const { return m_data.data(); }
+   // Discards any accumulated data, giving its blocks back to the pool.
+   void clear();
 
-   // Discards any accumulated data.
-   void clear() { m_data.clear(); }
+   // Sets the number of decimal places (0 to 6) used by AddNumber.
+   void SetDecimals(int decimals) { m_decimals = decimals; }
 
+   // Sets the number of bytes of data (0 for no limit) that may be
+   // kept in memory.  Beyond that, the data is moved to a temporary
+   // file.  The threshold is rounded up to a whole number of blocks.
+   // Errors throw.
+   void SetSpillThreshold(size_t numBytes) { m_spillThreshold = numBytes; }
+   size_t GetSpillThreshold() const { return m_spillThreshold; }
 
-   // Storage for the stream's accumulated data.
-   std::vector<unsigned char> m_data;
+   // Calls the given function for each consecutive piece of the
+   // stream's data, in order, so that the data can be written or
+   // compressed without needing it all in one contiguous buffer.
+   // Errors throw.
+   void ForEachChunk(const std::function<void(const unsigned char *data, size_t numBytes)> &function) const;
+
+   // Writes all of the stream's data to the given sink.  Errors throw.
+   void WriteTo(PDFOutputSink &sink) const;
+
+   //---------------------------------------------------------------
+   // Starts compressing the stream's data with the given deflater
+   // as the data is added, a block at a time, so that only the
+   // compressed data is kept (in the deflater's output stream
+   // accumulator) plus one block of uncompressed data.  The stream
+   // must be empty.  The deflater must stay alive until EndDeflate
+   // or clear is called.  Errors throw.
+   //---------------------------------------------------------------
+   void BeginDeflate(PDFDeflater &deflater);
+
+   // Compresses the rest of the stream's data and finishes the
+   // deflater's stream of compressed data.  Afterward the stream
+   // has no data left to read, but size still returns the number
+   // of uncompressed bytes added.  Errors throw.
+   void EndDeflate();
+
+   // Returns true between BeginDeflate and EndDeflate.
+   bool IsDeflating() const { return m_deflater != nullptr; }
+
+   // Stops compressing the stream's data and cancels the deflater,
+   // keeping the data as it is, if none of the data has been given
+   // to the deflater yet.  Returns true if so.  Errors throw.
+   bool CancelDeflate();
+
+   // Moves the stream's data that's in memory to the temporary file
+   // now, regardless of the spill threshold, so that the memory can
+   // be reused.  Does nothing while the data is being compressed or
+   // written to a file as it's added.  Errors throw.
+   void Spill()
+   {
+      if (m_deflater == nullptr && m_writeThroughSink == nullptr && !m_blocks.empty())
+         DoSpill();
+   }
+
+   //---------------------------------------------------------------
+   // Starts writing the stream's data to the given sink as the data
+   // is added, a block at a time, so that only one block of data is
+   // kept in memory.  The stream must be empty, and nothing else
+   // may be written to the sink until EndWriteThrough is called.
+   // Errors throw.
+   //---------------------------------------------------------------
+   void BeginWriteThrough(PDFOutputSink &sink);
+
+   // Writes the rest of the stream's data to the sink.  Afterward
+   // the stream has no data left to read, but size still returns
+   // the number of bytes added.  Errors throw.
+   void EndWriteThrough();
+
+private:
+   void DoAddBlock();
+   void DoPassOn(const unsigned char *data, size_t numBytes);
+   void DoPassOnLastBlock();
+   void DoSpill();
+
+   // Pool that the blocks come from, which is m_ownPool unless a
+   // pool was given to the constructor.
+   PDFBlockPool   m_ownPool;
+   PDFBlockPool * m_pool;
+
+   // Blocks holding the stream's accumulated data that's in memory.
+   // All blocks but the last are full.  The free part of the last
+   // block runs from m_writePos to m_writeEnd.
+   std::pmr::vector<unsigned char *> m_blocks;
+   unsigned char * m_writePos = nullptr;
+   unsigned char * m_writeEnd = nullptr;
+
+   // Temporary file holding the first m_spilledBytes bytes of the
+   // stream's data, if the data exceeded m_spillThreshold.
+   FILE *   m_spillFile = nullptr;
+   size_t   m_spilledBytes = 0;
+   size_t   m_spillThreshold = 0;
+
+   // Deflater that the stream's data is compressed with while
+   // BeginDeflate is in effect, or sink that the stream's data is
+   // written to while BeginWriteThrough is in effect, and the
+   // number of bytes of data that have been passed on so far.
+   PDFDeflater *     m_deflater = nullptr;
+   PDFOutputSink *   m_writeThroughSink = nullptr;
+   size_t         m_passedOnBytes = 0;
+
+   // Number of decimal places used by AddNumber.
+   int m_decimals = 6;
+};
+
+//--------------------------------------------------------------------
+// Class to write the operators of a PDF page content stream to a
+// stream accumulator.  Each operator has its own function with typed
+// operands, so the operator's name and number of operands are fixed
+// at compile time, and each operator line is formatted on the stack
+// and added to the stream with a single AddData.
+//--------------------------------------------------------------------
+class PDFContentWriter
+{
+public:
+   explicit PDFContentWriter(PDFStreamAccumulator &stream) : m_stream(stream) { }
+   PDFContentWriter(const PDFContentWriter &copy) = delete;
+   ~PDFContentWriter() = default;
+
+   //---------------------------------------------------------------
+   // Sets the number of content stream units per point for integer
+   // coordinate mode, or zero to turn integer coordinate mode off.
+   // In integer coordinate mode, coordinates given to the operator
+   // functions (in points) are multiplied by this and written as
+   // integers, and lengths (line widths, text sizes, image sizes)
+   // are multiplied by this too.  The content stream must start
+   // with a PageScale of the same number of units per point.
+   //---------------------------------------------------------------
+   void SetUnitsPerPoint(double unitsPerPoint) { m_unitsPerPoint = unitsPerPoint; }
+   double GetUnitsPerPoint() const { return m_unitsPerPoint; }
+
+   // Scales the page's coordinate system for integer coordinate
+   // mode, so that one unit is 1/unitsPerPoint of a point.
+   void PageScale(double unitsPerPoint)
+   {
+      const Exact scale = { 1. / unitsPerPoint };
+      Op("cm", scale, 0., 0., scale, 0., 0.);
+   }
+
+   // Path construction operators.
+   void MoveTo(double x, double y)        { Op("m", Coord{x}, Coord{y}); }
+   void LineTo(double x, double y)        { Op("l", Coord{x}, Coord{y}); }
+   void ClosePath()                       { Op("h"); }
+   void Rectangle(double x, double y, double width, double height)
+      { Op("re", Coord{x}, Coord{y}, Length{width}, Length{height}); }
+
+   // Path painting operators.  The fills use the even-odd rule.
+   void Stroke()                          { Op("S"); }
+   void FillEvenOdd()                     { Op("f*"); }
+   void FillStrokeEvenOdd()               { Op("B*"); }
+
+   // Graphics state operators.
+   void SaveState()                       { Op("q"); }
+   void RestoreState()                    { Op("Q"); }
+   void LineWidth(double width)           { Op("w", Length{width}); }
+   void LineCap(int style)                { Op("J", style); }
+   void StrokeColor(const PDFColor &color)
+      { Op("RG", color.m_red, color.m_green, color.m_blue); }
+   void FillColor(const PDFColor &color)
+      { Op("rg", color.m_red, color.m_green, color.m_blue); }
+   void StrokeGray(double gray)           { Op("G", gray); }
+   void FillGray(double gray)             { Op("g", gray); }
+   void Transform(double a, double b, double c, double d, double e, double f)
+      { Op("cm", Length{a}, Length{b}, Length{c}, Length{d}, Coord{e}, Coord{f}); }
+
+   // Draws the image XObject named "/Im<index>".
+   void DrawImage(size_t index)           { Name("/Im", index, "Do"); }
+
+   // Text operators.  Font selects the font named "/F<index>".
+   void BeginText()                       { Op("BT"); }
+   void EndText()                         { Op("ET"); }
+   void Font(size_t index, double size)   { Name("/F", index, "Tf", Length{size}); }
+   void TextPosition(double x, double y)  { Op("Td", Coord{x}, Coord{y}); }
+
+   // Shows a text string.  The text must already be escaped as
+   // needed for a PDF string literal.
+   void ShowText(const char *text, size_t length)
+   {
+      m_stream.AddData("(", 1);
+      m_stream.AddData(text, length);
+      m_stream.AddData(") Tj\r\n", 6);
+   }
+
+private:
+   // Types of operands that are written differently in integer
+   // coordinate mode.  Plain double operands (e.g. colors) are
+   // always written as they are.
+   struct Coord { double m_value; };   // A coordinate in points.
+   struct Length { double m_value; };  // A distance in points.
+   struct Exact { double m_value; };   // A number written with all decimal places.
+
+   //---------------------------------------------------------------
+   // Writes an operator with the given numeric operands to the
+   // stream, e.g. "10 20 m".
+   //---------------------------------------------------------------
+   template <size_t N, typename... Operands>
+   void Op(const char (&op)[N], Operands... operands)
+   {
+      char buffer[sizeof...(Operands) * (PDFStreamAccumulator::maxNumberLength + 1) + N + 2];
+      size_t length = 0;
+      const int expand[] = { 0, (length += AddOperand(buffer + length, operands), 0)... };
+      (void)expand;
+      AddOperator(buffer, length, op);
+   }
+
+   //---------------------------------------------------------------
+   // Writes an operator whose first operand is a numbered resource
+   // name, followed by any numeric operands, e.g. "/F1 12 Tf".
+   //---------------------------------------------------------------
+   template <size_t P, size_t N, typename... Operands>
+   void Name(const char (&prefix)[P], size_t index, const char (&op)[N], Operands... operands)
+   {
+      char buffer[(sizeof...(Operands) + 1) * (PDFStreamAccumulator::maxNumberLength + 1) + P + N + 2];
+      memcpy(buffer, prefix, P - 1);
+      size_t length = P - 1;
+      length += PDFStreamAccumulator::FormatInteger(buffer + length, static_cast<long long>(index));
+      buffer[length++] = ' ';
+      const int expand[] = { 0, (length += AddOperand(buffer + length, operands), 0)... };
+      (void)expand;
+      AddOperator(buffer, length, op);
+   }
+
+   // Formats one numeric operand followed by a space.
+   size_t AddOperand(char *buffer, double value)
+   {
+      size_t length = m_stream.FormatNumber(buffer, value);
+      buffer[length++] = ' ';
+      return length;
+   }
+   size_t AddOperand(char *buffer, Coord coord)
+   {
+      if (m_unitsPerPoint <= 0.)
+         return AddOperand(buffer, coord.m_value);
+      size_t length = PDFStreamAccumulator::FormatInteger(buffer,
+         static_cast<long long>(floor(coord.m_value * m_unitsPerPoint + 0.5)));
+      buffer[length++] = ' ';
+      return length;
+   }
+   size_t AddOperand(char *buffer, Length distance)
+   {
+      if (m_unitsPerPoint <= 0.)
+         return AddOperand(buffer, distance.m_value);
+      return AddOperand(buffer, distance.m_value * m_unitsPerPoint);
+   }
+   size_t AddOperand(char *buffer, Exact exact)
+   {
+      size_t length = PDFStreamAccumulator::FormatExactNumber(buffer, exact.m_value);
+      buffer[length++] = ' ';
+      return length;
+   }
+
+   // Appends the operator and a line break to the operands in the
+   // buffer, and adds the whole line to the stream.
+   template <size_t N>
+   void AddOperator(char *buffer, size_t length, const char (&op)[N])
+   {
+      memcpy(buffer + length, op, N - 1);
+      length += N - 1;
+      buffer[length++] = '\r';
+      buffer[length++] = '\n';
+      m_stream.AddData(buffer, length);
+   }
+
+   // The stream to which the operators are written.
+   PDFStreamAccumulator &m_stream;
+
+   // Content stream units per point in integer coordinate mode, or
+   // zero if coordinates are written as decimal numbers.
+   double m_unitsPerPoint = 0.;
 };
 
 //--------------------------------------------------------------------
@@ -288,7 +1339,17 @@ public:
 class Draw2pdf
 {
 public:
-   Draw2pdf() = default;
+   //---------------------------------------------------------------
+   // All of the memory that the object allocates comes from the
+   // given memory resource, which must outlive the object.  Memory
+   // that's only needed until the end of a page comes from a page
+   // arena (itself fed by the memory resource) which is reset at
+   // the end of each page, and stream buffers are reused from page
+   // to page, so drawing pages makes no allocations once the object
+   // has grown to fit the biggest page.
+   //---------------------------------------------------------------
+   explicit Draw2pdf(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+      m_totalMemory(resource) { }
    Draw2pdf(const Draw2pdf &copy) = delete;
    ~Draw2pdf();
 
@@ -296,13 +1357,94 @@ public:
    // Opens a new PDF file for writing.  Errors throw.
    // The dimensions of the page(s) in the PDF file should be given
    // in units of typesetting points (1 point = 1/72 inch).
+   //
+   // If integerUnitsPerPoint is nonzero, integer coordinate mode is
+   // used:  each page's content stream starts with a transform that
+   // scales the page to integerUnitsPerPoint units per point (e.g.
+   // 100 for 1/100 point units), and all coordinates drawn on the
+   // page are rounded to those units and written as integers.  Line
+   // widths, text sizes and image sizes are scaled to match, so the
+   // drawing looks the same.  Integers are faster to write and
+   // compress better than decimal numbers.  More than
+   // maxIntegerUnitsPerPoint units per point throws.
    //---------------------------------------------------------------
    void Open(const std::wstring &filename,
             const PDFPoint &pageMinimumPoints,
-            const PDFPoint &pageMaximumPoints);
+            const PDFPoint &pageMaximumPoints,
+            size_t integerUnitsPerPoint = 0);
+
+   // Most units per point for integer coordinate mode.
+   static constexpr size_t maxIntegerUnitsPerPoint = 10000;
+
+   //---------------------------------------------------------------
+   // Starts a new PDF file, which is written to the given output
+   // sink instead of to a file, e.g. to generate the PDF file in
+   // memory with a PDFMemorySink.  The sink must stay alive until
+   // Close is called.  Otherwise the same as opening a file.
+   // Errors throw.
+   //---------------------------------------------------------------
+   void Open(PDFOutputSink &sink,
+            const PDFPoint &pageMinimumPoints,
+            const PDFPoint &pageMaximumPoints,
+            size_t integerUnitsPerPoint = 0);
+
+   //---------------------------------------------------------------
+   // Starts a new PDF file whose data is pulled out of the object
+   // with ReadOutput, instead of being written anywhere.  Each page
+   // is made available as soon as it's finished.  Otherwise the
+   // same as opening a file.  Errors throw.
+   //---------------------------------------------------------------
+   void OpenForReading(const PDFPoint &pageMinimumPoints,
+            const PDFPoint &pageMaximumPoints,
+            size_t integerUnitsPerPoint = 0);
+
+   //---------------------------------------------------------------
+   // Sets the most data of a PDF file opened with OpenForReading to
+   // hold until it's read.  If blocking, drawing waits at that
+   // point until ReadOutput is called from another thread.  If not
+   // blocking, IsOutputBlocked returns true at that point, and the
+   // caller should read the data before drawing more.  The default
+   // is 1MB, blocking.  Takes effect in the next OpenForReading.
+   //---------------------------------------------------------------
+   void SetOutputHighWaterMark(size_t numBytes, bool blocking = true)
+   {
+      m_pullHighWaterMark = numBytes;
+      m_pullBlocking = blocking;
+   }
 
    //---------------------------------------------------------------
-   // Finishes writing the currently open PDF file.  Errors throw.
+   // Copies up to the given number of bytes of the next data of a
+   // PDF file opened with OpenForReading to the given buffer, and
+   // returns the number of bytes copied.  May be called from a
+   // different thread than the one drawing.  If blocking, waits
+   // until there is some data.  Returns 0 at the end of the file
+   // (see IsOutputComplete), after the output is cancelled or the
+   // file is abandoned, or if not blocking and there's no data yet.
+   //---------------------------------------------------------------
+   size_t ReadOutput(void *buffer, size_t maxBytes) { return m_pullSink.Read(buffer, maxBytes); }
+
+   // Returns true if data of a PDF file opened with OpenForReading
+   // has reached the high-water mark and should be read.
+   bool IsOutputBlocked() const { return m_pullSink.IsFull(); }
+
+   // Returns true if a PDF file opened with OpenForReading has been
+   // closed and all of its data has been read.  Stays false if the
+   // file was abandoned, so the data read is incomplete.
+   bool IsOutputComplete() const { return m_pullSink.IsComplete(); }
+
+   //---------------------------------------------------------------
+   // Makes drawing to a PDF file opened with OpenForReading throw
+   // from then on, e.g. if the reader's client went away.  The file
+   // should then be closed, which throws too and abandons the file,
+   // after which the object is ready for the next file.
+   //---------------------------------------------------------------
+   void CancelOutput() { m_pullSink.Cancel(); }
+
+   //---------------------------------------------------------------
+   // Finishes writing the currently open PDF file.  If that fails,
+   // e.g. because the disk is full, the file is abandoned and left
+   // unfinished, and the error throws.  Either way, no PDF file is
+   // open afterward.
    //---------------------------------------------------------------
    void Close();
 
@@ -334,14 +1476,129 @@ public:
    // Draws a polyline using the current line style.
    // The point coordinates are given in units of points.
    //---------------------------------------------------------------
-   void DrawPolyline(const std::vector<PDFPoint> &points);
+   void DrawPolyline(const PDFPoint *points, size_t count);
+   void DrawPolyline(const std::vector<PDFPoint> &points)
+      { DrawPolyline(points.data(), points.size()); }
 
    //---------------------------------------------------------------
    // Draws a (non-compound) polygon using the current line and
    // fill styles.
    // The point coordinates are given in units of points.
    //---------------------------------------------------------------
-   void DrawPolygon(const std::vector<PDFPoint> &points);
+   void DrawPolygon(const PDFPoint *points, size_t count);
+   void DrawPolygon(const std::vector<PDFPoint> &points)
+      { DrawPolygon(points.data(), points.size()); }
+
+   //---------------------------------------------------------------
+   // Draws several polylines (or polygons) whose vertices are all
+   // stored in one array, without copying the vertices.  This is
+   // the fastest way to draw large numbers of features, e.g. the
+   // features of a map.
+   //
+   // Each part (polyline or polygon) is a run of consecutive points
+   // in the points array.  partOffsets holds the index in the
+   // points array of the first point of each of the numParts parts,
+   // in increasing order, starting with 0.  Each part ends where
+   // the next one starts, and the last part ends at numPoints.
+   // Invalid offsets throw, including offsets that would leave some
+   // of the points out of every part.
+   //
+   // The polylines are drawn with the current line style, and the
+   // polygons with the current line and fill styles.  Each polygon
+   // is filled separately, as if drawn by DrawPolygon.
+   //---------------------------------------------------------------
+   void DrawPolylines(const PDFPoint *points, size_t numPoints,
+                      const size_t *partOffsets, size_t numParts);
+   void DrawPolygons(const PDFPoint *points, size_t numPoints,
+                     const size_t *partOffsets, size_t numParts);
+
+   //---------------------------------------------------------------
+   // Versions of the polyline and polygon drawing functions for
+   // arrays of any point type supported by PDFPointTraits (see
+   // above), e.g. points with float or integer coordinates.  The
+   // coordinates are read straight from the given array; nothing
+   // is copied.
+   //---------------------------------------------------------------
+   template <typename PointType>
+   void DrawPolyline(const PointType *points, size_t count)
+   {
+      if (!DoBeginPolyline())
+         return;
+      for (size_t index = 0; index < count; ++index)
+         DoPathVertex(PDFPoint(PDFPointTraits<PointType>::X(points[index]),
+                               PDFPointTraits<PointType>::Y(points[index])));
+      DoEndPolyline();
+   }
+
+   template <typename PointType>
+   void DrawPolyline(const std::vector<PointType> &points)
+      { DrawPolyline(points.data(), points.size()); }
+
+   template <typename PointType>
+   void DrawPolygon(const PointType *points, size_t count)
+   {
+      if (!DoBeginPolygon())
+         return;
+      for (size_t index = 0; index < count; ++index)
+         DoPathVertex(PDFPoint(PDFPointTraits<PointType>::X(points[index]),
+                               PDFPointTraits<PointType>::Y(points[index])));
+      DoEndPolygon();
+   }
+
+   template <typename PointType>
+   void DrawPolygon(const std::vector<PointType> &points)
+      { DrawPolygon(points.data(), points.size()); }
+
+   template <typename PointType>
+   void DrawPolylines(const PointType *points, size_t numPoints,
+                      const size_t *partOffsets, size_t numParts)
+   {
+      DoCheckParts(numPoints, partOffsets, numParts);
+      for (size_t part = 0; part < numParts; ++part)
+      {
+         const size_t first = partOffsets[part];
+         const size_t last = (part + 1 < numParts) ? partOffsets[part + 1] : numPoints;
+         DrawPolyline(points + first, last - first);
+      }
+   }
+
+   template <typename PointType>
+   void DrawPolygons(const PointType *points, size_t numPoints,
+                     const size_t *partOffsets, size_t numParts)
+   {
+      DoCheckParts(numPoints, partOffsets, numParts);
+      for (size_t part = 0; part < numParts; ++part)
+      {
+         const size_t first = partOffsets[part];
+         const size_t last = (part + 1 < numParts) ? partOffsets[part + 1] : numPoints;
+         DrawPolygon(points + first, last - first);
+      }
+   }
+
+   //---------------------------------------------------------------
+   // Versions of the polyline and polygon drawing functions for
+   // coordinates stored in separate x and y arrays (of any numeric
+   // type), each holding count values.
+   //---------------------------------------------------------------
+   template <typename CoordType>
+   void DrawPolyline(const CoordType *xs, const CoordType *ys, size_t count)
+   {
+      if (!DoBeginPolyline())
+         return;
+      for (size_t index = 0; index < count; ++index)
+         DoPathVertex(PDFPoint(static_cast<double>(xs[index]), static_cast<double>(ys[index])));
+      DoEndPolyline();
+   }
+
+   template <typename CoordType>
+   void DrawPolygon(const CoordType *xs, const CoordType *ys, size_t count)
+   {
+      if (!DoBeginPolygon())
+         return;
+      for (size_t index = 0; index < count; ++index)
+         DoPathVertex(PDFPoint(static_cast<double>(xs[index]), static_cast<double>(ys[index])));
+      DoEndPolygon();
+   }
 
    //---------------------------------------------------------------
    // Draws a rectangle using the current line and fill styles.
@@ -355,6 +1612,20 @@ public:
    //---------------------------------------------------------------
    void DrawTextString(const PDFPoint &point, const std::wstring &text);
 
+   //---------------------------------------------------------------
+   // Draws several text strings (e.g. map labels) at once using
+   // the current text style.  The positions are given in points.
+   // Consecutive text strings are written to the PDF file as a
+   // single text object whether they are drawn with this or with
+   // DrawTextString, but this sets up the text style and checks
+   // the memory budget once for all of the strings rather than once
+   // per string.  Only a content stream split (see
+   // SetContentSplitSize) in the middle of the strings repeats it.
+   //---------------------------------------------------------------
+   void DrawTextStrings(const PDFTextItem *items, size_t count);
+   void DrawTextStrings(const std::vector<PDFTextItem> &items)
+      { DrawTextStrings(items.data(), items.size()); }
+
    //---------------------------------------------------------------
    // Draws a bitmap (raster) image at the specified position and
    // size (in points) on the page.
@@ -392,19 +1663,327 @@ public:
    //---------------------------------------------------------------
    void EnableImageCompression(bool enable) { m_compressImages = enable; }
 
+   //---------------------------------------------------------------
+   // Enable or disable PNG predictors for compressed images (the
+   // default).  Each scanline is filtered with whichever of the
+   // PNG filters (None, Sub, Up, Average or Paeth) leaves the
+   // smallest differences before it's compressed, which makes
+   // photographs and gradients compress much better.  Only matters
+   // if image compression is enabled.  Takes effect in subsequent
+   // images.
+   //---------------------------------------------------------------
+   void EnableImagePredictors(bool enable) { m_predictImages = enable; }
+
    //---------------------------------------------------------------
    // Enable or disable compression of page content stream data
    // in subsequent pages.
    //---------------------------------------------------------------
    void EnableContentCompression(bool enable) { m_compressContent = enable; }
 
+   //---------------------------------------------------------------
+   // Sets how content streams and images are compressed, when their
+   // compression is enabled: the compression level (e.g. 1 for fast
+   // previews, 9 for archiving), window size, memory level and
+   // strategy, and the smallest stream worth compressing.  A content
+   // stream that's compressed as it's drawn is left uncompressed
+   // only if it stays under 64KB, and one that's written as it's
+   // drawn is always compressed.  Takes effect in subsequent
+   // streams.
+   //---------------------------------------------------------------
+   void SetCompressionPolicy(const PDFCompressionPolicy &policy)
+   {
+      m_compressionPolicy = policy;
+      m_contentDeflater.SetSettings(policy.m_content);
+      m_imageDeflater.SetSettings(policy.m_images);
+   }
+
+   // Returns the current compression policy.
+   const PDFCompressionPolicy &GetCompressionPolicy() const { return m_compressionPolicy; }
+
+   //---------------------------------------------------------------
+   // Enable or disable compressing page content stream data while
+   // the page is being drawn (the default), rather than all at once
+   // when the page is finished.  Compressing while drawing keeps
+   // only the compressed data in memory and leaves little work to
+   // do at the end of the page.  The compressed data is the same
+   // either way.  Only matters if content compression is enabled.
+   // Takes effect in subsequent pages.
+   //---------------------------------------------------------------
+   void EnableIncrementalCompression(bool enable) { m_compressIncrementally = enable; }
+
+   //---------------------------------------------------------------
+   // Enable or disable writing each page's content stream straight
+   // to the PDF file while the page is being drawn (through a small
+   // write buffer), instead of keeping it until the page is
+   // finished.  The content stream's length is then written in a
+   // separate object after the stream.  If content compression is
+   // enabled, the content is compressed while it's drawn.  This
+   // lets pages of any size be written with constant memory.
+   // Takes effect in subsequent pages.
+   //---------------------------------------------------------------
+   void EnableContentStreaming(bool enable) { m_streamContent = enable; }
+
+   //---------------------------------------------------------------
+   // Enable or disable writing the PDF file from a separate writer
+   // thread, so that drawing can continue while earlier parts of
+   // the file are written to the disk.  Close waits until all of
+   // the file has been written.  The writer thread's buffers
+   // (about 1.25MB) count against the memory budget.  Takes effect
+   // when the next PDF file is opened.
+   //---------------------------------------------------------------
+   void EnableAsyncOutput(bool enable) { m_asyncOutput = enable; }
+
+   //---------------------------------------------------------------
+   // Enable or disable always ending the PDF file with a cross
+   // reference stream (PDF 1.5) instead of the classic cross
+   // reference table.  A cross reference stream is always used if
+   // the PDF file is too big for the classic table, which can only
+   // hold offsets of up to 10 digits (about 9.3GB).  Takes effect
+   // when the PDF file is closed.
+   //---------------------------------------------------------------
+   void EnableCrossRefStream(bool enable) { m_crossRefStream = enable; }
+
+   //---------------------------------------------------------------
+   // Sets the number of threads used to compress large content
+   // streams and images (see PDFDeflater::SetThreadCount).  Zero
+   // uses one thread per processor core.  The default is one, which
+   // compresses on the calling thread.  The compressed data is
+   // still ordinary /FlateDecode data.  Takes effect in subsequent
+   // streams.
+   //---------------------------------------------------------------
+   void EnableParallelCompression(size_t numThreads)
+   {
+      m_contentDeflater.SetThreadCount(numThreads);
+      m_imageDeflater.SetThreadCount(numThreads);
+   }
+
+   //---------------------------------------------------------------
+   // Sets the number of bytes of (uncompressed) content data after
+   // which a page's content stream object is finished and a new one
+   // is started (0 for no limit, which is the default).  The page
+   // then refers to all of its content streams in a /Contents array.
+   // Each content stream is written to the PDF file as soon as it's
+   // finished, so this bounds the memory used per page, and avoids
+   // very large streams that some PDF viewers have trouble with.
+   //---------------------------------------------------------------
+   void SetContentSplitSize(size_t numBytes) { m_contentSplitSize = numBytes; }
+
+   //---------------------------------------------------------------
+   // Sets the number of bytes of page content data (0 for no limit,
+   // which is the default) that may be kept in memory for the page
+   // being drawn, and for the compressed copy of it if compression
+   // is enabled.  Beyond that, the data is kept in temporary files
+   // on disk and copied to the PDF file in pieces when the page is
+   // finished, so pages of any size can be drawn with bounded
+   // memory.
+   //---------------------------------------------------------------
+   void SetContentSpillThreshold(size_t numBytes)
+   {
+      m_contentStream.SetSpillThreshold(numBytes);
+      m_encodedStream.SetSpillThreshold(numBytes);
+   }
+
+   //---------------------------------------------------------------
+   // Sets the number of bytes of memory (0 for no limit, which is
+   // the default) that the object should try to stay within.  When
+   // drawing takes the memory held over the budget, memory is freed
+   // by spilling the page's content stream data to a temporary file
+   // and by writing the page's images to the PDF file early (unless
+   // the page's content is being written to the PDF file as it's
+   // drawn, which uses little memory anyway).  Memory that can't be
+   // freed this way, such as ZLIB's state, can still exceed the
+   // budget.
+   //---------------------------------------------------------------
+   void SetMemoryBudget(size_t numBytes) { m_memoryBudget = m_memoryLimit = numBytes; }
+
+   //---------------------------------------------------------------
+   // Returns statistics about the memory held by the object.
+   //---------------------------------------------------------------
+   PDFMemoryStats GetMemoryStats() const;
+
+   //---------------------------------------------------------------
+   // Starts counting the peak numbers of the memory statistics over
+   // again from the current numbers.
+   //---------------------------------------------------------------
+   void ResetPeakMemoryStats();
+
+   //---------------------------------------------------------------
+   // Sets the number of decimal places (0 to 6, default 6) used for
+   // the numbers (coordinates, colors, line widths, page sizes)
+   // written to the PDF file.  It takes effect at once, so it also
+   // applies to anything drawn after it on the current page.
+   // Numbers are rounded to this many decimal places and trailing
+   // zeros are omitted, so fewer decimal places make the PDF file
+   // smaller.
+   //---------------------------------------------------------------
+   void SetNumberPrecision(int decimals);
+
+   //---------------------------------------------------------------
+   // Same as SetNumberPrecision, but chooses the fewest decimal
+   // places that keep the rounding error of the numbers within the
+   // given distance (in points).  For example, a tolerance of 0.01
+   // points selects 2 decimal places.
+   //---------------------------------------------------------------
+   void SetNumberTolerance(double maxErrorPoints);
+
+   // Maximum number of decimal places for SetNumberPrecision.
+   static constexpr int maxNumberDecimals = 6;
+
+   //---------------------------------------------------------------
+   // Enable or disable removal of redundant vertices from lines,
+   // polylines and polygons drawn after this call.  When enabled,
+   // consecutive vertices that would be written with the same
+   // coordinates are reduced to one, and a vertex is dropped if it
+   // lies within collinearTolerance points of the straight line
+   // between its neighbors.  A line or polyline whose vertices are
+   // all the same point is drawn as a round dot.
+   //---------------------------------------------------------------
+   void EnableGeometryCleanup(bool enable, double collinearTolerance = 0.);
+
+   //---------------------------------------------------------------
+   // Enable or disable stroke batching (enabled by default).  When
+   // enabled, consecutive lines and polylines drawn with the same
+   // line style are written as subpaths of a single path that is
+   // stroked once, when the style changes, something else is drawn,
+   // or the page ends.  The page looks the same, but it has far
+   // fewer stroke operations and so renders much faster in PDF
+   // viewers.
+   //---------------------------------------------------------------
+   void EnableStrokeBatching(bool enable) { DoFlushStroke(); m_batchStrokes = enable; }
+
+   //---------------------------------------------------------------
+   // Returns statistics about the drawing on the given page
+   // (zero-based) of the current or most recently written PDF file.
+   //---------------------------------------------------------------
+   const PDFPageStats &GetPageStats(size_t pageIndex) const { return m_pageStats.at(pageIndex); }
+
+   //---------------------------------------------------------------
+   // Returns the number of pages in the current or most recently
+   // written PDF file.
+   //---------------------------------------------------------------
+   size_t GetPageCount() const { return m_pageStats.size(); }
+
+   //---------------------------------------------------------------
+   // Returns statistics about the given stream (zero-based, in the
+   // order written) of the current or most recently written PDF
+   // file:  its size before and after encoding, and the time spent
+   // compressing it.
+   //---------------------------------------------------------------
+   const PDFStreamStats &GetStreamStats(size_t streamIndex) const { return m_streamStats.at(streamIndex); }
+
+   //---------------------------------------------------------------
+   // Returns the number of content streams and images written so
+   // far to the current or most recently written PDF file.
+   //---------------------------------------------------------------
+   size_t GetStreamCount() const { return m_streamStats.size(); }
+
 private:
+   void DoFinishFile();
+   void DoEndFile() noexcept;
    void DoBeginPage();
    void DoEndPage();
+   void DoBeginContent();
+   void DoEndContent();
+   void DoSplitContent();
+   void DoWritePageObject();
+   void DoWriteContent();
+   void DoEndStreamedContent();
    void DoWriteImage(size_t index, bool compress);
+   void DoDeflatePredicted(size_t index, size_t bytesPerPixel);
+   void DoAddStreamStats(size_t objNum, bool image, size_t rawBytes, size_t encodedBytes,
+                         const PDFDeflater *deflater);
+   bool DoBeginPolyline();
+   void DoEndPolyline();
+   bool DoBeginPolygon();
+   void DoEndPolygon();
+   static void DoCheckUnitsPerPoint(size_t integerUnitsPerPoint);
+   void DoCheckParts(size_t numPoints, const size_t *partOffsets, size_t numParts);
+   void DoBeginPath();
+   void DoPathVertex(const PDFPoint &point);
+   size_t DoEndPath(bool closed, bool stroked);
+   void DoWriteVertex(const PDFPoint &point);
+   void DoWriteDot(const PDFPoint &point);
+   double DoRoundCoordinate(double value) const;
+   double DoCoordinateEpsilon() const;
+   void DoFlushStroke();
+   void DoFlushText();
+   void DoBeginText();
+   void DoShowText(const PDFPoint &point, const std::wstring &text);
+   void DoApplyStrokeState(int lineCap);
+   void DoApplyFillColor(const PDFColor &color);
+   void DoReduceMemory();
+   void DoBeginObject(size_t objNum);
+   void DoWriteCrossRefTable();
+   uint64_t DoWriteCrossRefStream(int id);
+
+   // Starts a new content stream object for the page, if the
+   // current one has reached the split size.
+   void DoCheckContentSplit()
+   {
+      if (DoContentSplitDue())
+         DoSplitContent();
+   }
+   bool DoContentSplitDue() const
+   {
+      return m_contentSplitSize != 0 && m_contentStream.size() >= m_contentSplitSize;
+   }
 
-   // File stream to the PDF file currently being written.
-   FILE * m_file = nullptr;
+   // Reduces the memory held, if it's over the memory budget.
+   void DoCheckMemoryBudget()
+   {
+      if (m_memoryBudget != 0 && m_totalMemory.GetLiveBytes() > m_memoryLimit)
+         DoReduceMemory();
+   }
+
+   // Memory resources that count the memory held by the object, in
+   // total and by category (see PDFMemoryStats).  All of the memory
+   // comes from the one given to the constructor, through these.
+   PDFMemoryTracker m_totalMemory;
+   PDFMemoryTracker m_streamMemory{&m_totalMemory};
+   PDFMemoryTracker m_imageMemory{&m_totalMemory};
+   PDFMemoryTracker m_compressionMemory{&m_totalMemory};
+
+   // Memory resource for memory that isn't in any other category.
+   std::pmr::memory_resource *m_resource = &m_totalMemory;
+
+   // Arena for memory that's only needed until the end of the page,
+   // which is mostly the page's images.
+   PDFPageArena m_pageArena{&m_imageMemory};
+
+   // An image waiting to be written at the end of the page.  The
+   // image's packed pixel data is kept in the page arena.
+   struct QueuedImage
+   {
+      size_t   m_numX = 0;
+      size_t   m_numY = 0;
+      size_t   m_bpp = 0;
+      size_t   m_objNum = 0;
+      const unsigned char *m_data = nullptr; // nullptr once written.
+      size_t   m_numBytes = 0;
+   };
+
+   // Sink that the PDF file currently being written goes to, by
+   // way of the writer, which buffers the data and keeps track of
+   // the offset in the PDF file.  The sink is nullptr if no PDF
+   // file is open.
+   PDFObjectWriter m_output{m_resource};
+
+   // File sink used when a PDF file is opened by name.
+   PDFFileSink m_fileSink;
+
+   // Sink that writes the PDF file from a writer thread, if that's
+   // enabled.  It's declared after the file sink so the writer
+   // thread is stopped before the file sink goes away.
+   PDFAsyncSink m_asyncSink{m_resource};
+   bool m_asyncOutput = false;
+
+   // Sink that the PDF file is read from, for OpenForReading, and
+   // whether the object writer is flushed at the end of each page
+   // so the reader gets each page as soon as it's finished.
+   PDFPullSink m_pullSink{m_resource};
+   size_t m_pullHighWaterMark = PDFPullSink::defaultHighWaterMark;
+   bool m_pullBlocking = true;
+   bool m_flushPages = false;
 
    // Extents of the page, in points.
    PDFPoint m_pageMinimumPoints;
@@ -415,9 +1994,24 @@ private:
    PDFFillStyle   m_fillStyle;
    PDFTextStyle   m_textStyle;
 
+   // Whether SetLineStyle has been called since the file was opened.
+   // Until it is, lines are drawn with PDF's default line width
+   // rather than the default PDFLineStyle's width.
+   bool           m_lineWidthSet = false;
+
+   // The graphics state in effect at the end of the page's content
+   // stream so far.  Drawing attributes are only written to the
+   // content stream when they differ from this.
+   PDFGraphicsState m_pdfState;
+
    // List of cross reference information for the objects in the PDF file.
    // This is used to generate the cross reference table at the end of the PDF file.
-   std::vector<PDFCrossRef> m_crossRefs;
+   std::pmr::vector<PDFCrossRef> m_crossRefs{m_resource};
+
+   // Largest offset the classic cross reference table can hold, and
+   // whether a cross reference stream is used even if not needed.
+   static constexpr uint64_t maxCrossRefTableOffset = 9999999999;
+   bool m_crossRefStream = false;
 
    // Next available object number in the current PDF file.
    size_t m_objNumber = 1;
@@ -425,23 +2019,114 @@ private:
    // Object numbers reserved for certain objects in the current PDF file.
    size_t m_catalogObjNumber = 0;
    size_t m_pagesObjNumber = 0;
+   size_t m_pageObjNumber = 0;
    size_t m_contentsObjNumber = 0;
    size_t m_xobjectObjNumber = 0;
 
+   // Object numbers of the current page's content stream objects.
+   std::pmr::vector<size_t> m_contentObjNumbers{m_resource};
+
+   // Content size at which the page's content stream is split (see
+   // SetContentSplitSize).
+   size_t m_contentSplitSize = 0;
+
+   // Object number of the current page's content stream length
+   // object, or 0 if the page's content isn't being written to the
+   // file as it's drawn.
+   size_t m_contentLengthObjNumber = 0;
+
    // List of PDF object numbers of each of the "Page" objects in the PDF file.
-   std::vector<size_t> m_pageObjectNumbers;
+   std::pmr::vector<size_t> m_pageObjectNumbers{m_resource};
+
+   // Pool of memory blocks for the stream accumulators, which is
+   // reused from page to page and from document to document.
+   PDFBlockPool m_blockPool{&m_streamMemory};
 
    // Storage for the page's graphic content stream.
-   PDFStreamAccumulator m_contentStream;
+   PDFStreamAccumulator m_contentStream{&m_blockPool};
+
+   // Storage for the compressed copy of the page's content stream.
+   PDFStreamAccumulator m_encodedStream{&m_blockPool};
+
+   // Writes the operators to the page's graphic content stream.
+   PDFContentWriter m_content{m_contentStream};
 
-   // Storage for the data of any images that need to be written to the PDF file.
-   std::vector<PDFImage> m_images;
+   // Images that need to be written to the PDF file.
+   std::pmr::vector<QueuedImage> m_images{m_resource};
 
    // True if images are compressed in the PDF file.
    bool m_compressImages = false;
 
+   // True if compressed images are filtered with PNG predictors.
+   bool m_predictImages = true;
+
    // True if page content streams are compressed in the PDF file.
    bool m_compressContent = false;
+
+   // True if page content stream data is compressed while the page
+   // is drawn, rather than when the page is finished.
+   bool m_compressIncrementally = true;
+
+   // True if page content stream data is written to the PDF file
+   // while the page is drawn.
+   bool m_streamContent = false;
+
+   // Compresses the page's content stream data.
+   PDFDeflater m_contentDeflater{&m_compressionMemory};
+
+   // Compresses images, and storage for the compressed image data.
+   // These are separate from the content's, since images may be
+   // written while the page's content is still being compressed.
+   PDFDeflater m_imageDeflater{&m_compressionMemory};
+   PDFStreamAccumulator m_imageStream{&m_blockPool};
+
+   // Number of decimal places for numbers written to the PDF file.
+   int m_numberDecimals = maxNumberDecimals;
+
+   // Geometry cleanup settings (see EnableGeometryCleanup).
+   bool     m_cleanupGeometry = false;
+   double   m_collinearTolerance = 0.;
+
+   // State of the path currently being written (see DoPathVertex).
+   size_t   m_pathInputCount = 0;   // Number of vertices given so far.
+   size_t   m_pathOutputCount = 0;  // Number of vertices written so far.
+   PDFPoint m_pathHeld;             // Most recent vertex given, not yet written.
+   PDFPoint m_pathFirst;            // First vertex written.
+   PDFPoint m_pathLast;             // Most recent vertex written.
+
+   // True if consecutive lines and polylines are stroked together.
+   bool     m_batchStrokes = true;
+
+   // True if lines or polylines have been written to the content
+   // stream but not yet stroked (see EnableStrokeBatching).
+   bool     m_strokePending = false;
+
+   // True if a text object (BT) has been started in the content
+   // stream but not yet ended (ET).
+   bool     m_textOpen = false;
+
+   // Start of the current line of text in the open text object, as
+   // set by the Td operators written so far.
+   PDFPoint m_textLineStart;
+
+   // Reused storage for converting text strings for the PDF file.
+   std::pmr::string m_textBuffer{m_resource};
+
+   // Memory budget (see SetMemoryBudget), the amount of memory held
+   // over which memory is next reduced, and the number of times it
+   // has been reduced.
+   size_t m_memoryBudget = 0;
+   size_t m_memoryLimit = 0;
+   size_t m_budgetFlushes = 0;
+
+   // Statistics for each page of the PDF file.
+   std::pmr::vector<PDFPageStats> m_pageStats{m_resource};
+
+   // Statistics about each stream of the current PDF file.
+   std::pmr::vector<PDFStreamStats> m_streamStats{m_resource};
+
+   // How content streams and images are compressed.
+   PDFCompressionPolicy m_compressionPolicy;
 };
 
 } // End namespace draw2pdf
@@ -3,6 +3,8 @@
 // A simple program to test the draw2pdf module.  When executed, this
 // program writes a selection of simple line and polygon graphics to
 // a PDF file named "test.pdf" in the current working directory. 
+// It also checks some of the module's other features, writing any
+// failures to the console.
 //
 // (C) Copyright 2022 Ammon R. Campbell.
 //
@@ -39,6 +41,7 @@
 //--------------------------------------------------------------------
 
 #include "draw2pdf.h"
+#include "Zlib.h"
 
 using namespace draw2pdf;
 
@@ -213,6 +216,395 @@ void TestDrawingRectangles(Draw2pdf &writer)
    DrawCaption(writer, 300., 450., L"Rectangles");
 }
 
+void DrawTestPages(Draw2pdf &writer)
+{
+   // Draw some test shapes on the first page.
+   DrawCornerMarks(writer);
+   TestDrawingLines(writer);
+   TestDrawingPolyline(writer);
+   TestDrawingPolygon(writer);
+   TestDrawingImage_8Bit(writer);
+   TestDrawingImage_24Bit(writer);
+   TestDrawingText(writer);
+   TestDrawingBigText(writer);
+
+   writer.NextPage();
+
+   // Draw some test shapes on the second page.
+   DrawCornerMarks(writer);
+   TestDrawingRectangles(writer);
+   TestDrawingPage2Text(writer);
+}
+
+bool TestCancelledOutput()
+{
+   // Start a PDF file that's read from memory and give up on it
+   // partway through, as if the reader's client went away.  Closing
+   // it must fail, and leave the writer ready for the next file.
+
+   Draw2pdf writer;
+   writer.SetOutputHighWaterMark(64 * 1024, false);
+   writer.OpenForReading(PDFPoint(0., 0.), PDFPoint(pageWidth, pageHeight));
+   DrawCornerMarks(writer);
+   writer.NextPage();
+   writer.CancelOutput();
+   try
+   {
+      writer.Close();
+      wprintf(L"Closing cancelled output didn't fail.\n");
+      return false;
+   }
+   catch (const PDFException &)
+   {
+   }
+
+   writer.OpenForReading(PDFPoint(0., 0.), PDFPoint(pageWidth, pageHeight));
+   DrawCornerMarks(writer);
+   writer.Close();
+   std::string data;
+   char buffer[4096];
+   for (size_t numBytes; (numBytes = writer.ReadOutput(buffer, sizeof(buffer))) > 0; )
+      data.append(buffer, numBytes);
+   if (!writer.IsOutputComplete() || data.compare(0, 8, "%PDF-1.4") != 0 ||
+       data.find("%%EOF") == std::string::npos)
+   {
+      wprintf(L"Output read after cancelled output is wrong.\n");
+      return false;
+   }
+
+   // Leave a cancelled file open for the destructor to abandon.
+   writer.OpenForReading(PDFPoint(0., 0.), PDFPoint(pageWidth, pageHeight));
+   DrawCornerMarks(writer);
+   writer.NextPage();
+   writer.CancelOutput();
+   return true;
+}
+
+bool TestSplitPointTypes()
+{
+   // Draw many polylines and polygons with float and integer points
+   // under a tiny content split size and a tiny memory budget.  The
+   // page's content must be split into several streams, and the
+   // memory must be reduced to stay in the budget,
+   // the same as for drawing with PDFPoints.
+
+   struct FloatPoint { float x, y; };
+   Draw2pdf writer;
+   writer.SetContentSplitSize(4096);
+   writer.SetMemoryBudget(1);
+   PDFMemorySink sink;
+   writer.Open(sink, PDFPoint(0., 0.), PDFPoint(pageWidth, pageHeight));
+   for (int row = 0; row < 500; row++)
+   {
+      const FloatPoint line[3] = { { 10.f, row + 10.f }, { 300.f, row + 20.f }, { 600.f, row + 10.f } };
+      writer.DrawPolyline(line, 3);
+      const int xs[3] = { 10, 20, 30 };
+      const int ys[3] = { row, row + 10, row };
+      writer.DrawPolygon(xs, ys, 3);
+   }
+   const size_t budgetFlushes = writer.GetMemoryStats().m_budgetFlushes;
+   writer.Close();
+
+   const std::string pdf(sink.GetData().begin(), sink.GetData().end());
+   const size_t contents = pdf.find("/Contents [");
+   if (budgetFlushes == 0 || contents == std::string::npos ||
+       pdf.find(" 0 R", pdf.find(" 0 R", contents) + 4) > pdf.find("]", contents))
+   {
+      wprintf(L"Drawing other point types didn't split the content or keep to the memory budget.\n");
+      return false;
+   }
+   return true;
+}
+
+bool GetStream(const std::string &pdf, size_t offset, std::string &dictionary, std::string &data)
+{
+   // Get the dictionary and the (still encoded) data of the stream
+   // object whose dictionary starts at or before the given offset
+   // in the PDF file.  The stream's length must be a direct number.
+
+   const size_t start = pdf.find("stream\r\n", offset);
+   const size_t length = pdf.find("/Length ", offset);
+   if (start == std::string::npos || length == std::string::npos || length > start)
+      return false;
+   dictionary = pdf.substr(offset, start - offset);
+
+   const size_t numBytes = strtoul(pdf.c_str() + length + 8, nullptr, 10);
+   if (start + 8 + numBytes > pdf.size())
+      return false;
+   data = pdf.substr(start + 8, numBytes);
+   return pdf.compare(start + 8 + numBytes, 11, "\r\nendstream") == 0;
+}
+
+bool InflateStream(const std::string &data, size_t numBytes, std::string &inflated)
+{
+   // Decompress data of a FlateDecode stream, which must decompress
+   // to exactly the given number of bytes.  ZLIB checks the data's
+   // checksum too.
+
+   inflated.resize(numBytes + 1);
+   uLongf inflatedBytes = static_cast<uLongf>(inflated.size());
+   if (uncompress(reinterpret_cast<Bytef *>(&inflated[0]), &inflatedBytes,
+                  reinterpret_cast<const Bytef *>(data.data()), static_cast<uLong>(data.size())) != Z_OK ||
+       inflatedBytes != numBytes)
+      return false;
+   inflated.resize(numBytes);
+   return true;
+}
+
+bool TestParallelCompression()
+{
+   // Compress grayscale images on several threads, which compress
+   // data bigger than one block (PDFDeflater::parallelBlockSize) a
+   // block at a time and join the pieces into one ZLIB stream.  The
+   // images are one pixel wide, so each image's data is exactly its
+   // height:  less than a block, exactly one or more blocks, and a
+   // byte more than that.  Each must decompress to the pixels.
+
+   const size_t blockSize = PDFDeflater::parallelBlockSize;
+   const size_t heights[] = { 1000, blockSize, blockSize + 1, 3 * blockSize, 3 * blockSize + 1 };
+
+   // Repeated text with some noise mixed in, so that the data
+   // compresses and refers back across the ends of blocks.
+   std::string pixels(3 * blockSize + 1, '\0');
+   unsigned int random = 1;
+   for (size_t i = 0; i < pixels.size(); i++)
+   {
+      random = random * 1103515245 + 12345;
+      pixels[i] = ((i / 5000) % 3 == 0 ? static_cast<char>(random >> 16) : "0 0 m 612 792 l S\r\n"[i % 20]);
+   }
+
+   Draw2pdf writer;
+   writer.EnableImageCompression(true);
+   writer.EnableImagePredictors(false);
+   writer.EnableParallelCompression(4);
+   PDFMemorySink sink;
+   writer.Open(sink, PDFPoint(0., 0.), PDFPoint(pageWidth, pageHeight));
+   for (const size_t height : heights)
+      writer.DrawImage(pixels.data(), 1, height, 8, 1, 100., 100., 100., 100.);
+   writer.Close();
+
+   const std::string pdf(sink.GetData().begin(), sink.GetData().end());
+   size_t offset = 0;
+   for (const size_t height : heights)
+   {
+      std::string dictionary, data, inflated;
+      offset = pdf.find("/Subtype /Image", offset);
+      if (offset == std::string::npos || !GetStream(pdf, offset, dictionary, data) ||
+          !InflateStream(data, height, inflated) || inflated.compare(0, height, pixels, 0, height) != 0)
+      {
+         wprintf(L"Image of %zu bytes compressed in parallel is wrong.\n", height);
+         return false;
+      }
+      offset += dictionary.size();
+   }
+   return true;
+}
+
+void UnfilterScanline(int filter, const unsigned char *in, const unsigned char *prev,
+                      size_t numBytes, size_t bytesPerPixel, unsigned char *out)
+{
+   // Undo the given PNG filter (0 = None, 1 = Sub, 2 = Up,
+   // 3 = Average, 4 = Paeth) on one scanline, given the previous
+   // unfiltered scanline (all zeros for the first).
+
+   for (size_t i = 0; i < numBytes; i++)
+   {
+      const int a = (i >= bytesPerPixel ? out[i - bytesPerPixel] : 0);
+      const int b = prev[i];
+      const int c = (i >= bytesPerPixel ? prev[i - bytesPerPixel] : 0);
+      int predicted = 0;
+      if (filter == 1)
+         predicted = a;
+      else if (filter == 2)
+         predicted = b;
+      else if (filter == 3)
+         predicted = (a + b) / 2;
+      else if (filter == 4)
+      {
+         const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+         predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+      }
+      out[i] = static_cast<unsigned char>(in[i] + predicted);
+   }
+}
+
+bool TestImagePredictors()
+{
+   // Compress 24 and 32 bit images with the PNG predictors, at
+   // widths whose scanlines aren't a multiple of 16 bytes.  Each
+   // image is made by undoing the filters on small random values,
+   // cycling through the filter types from one scanline to the
+   // next, so that each filter type is the best for some of the
+   // scanlines.  The images must decompress and unfilter to the
+   // pixels, and every filter type must have been used.
+
+   const size_t widths[] = { 37, 45 };
+   const size_t numY = 40;
+   std::vector<std::vector<unsigned char>> images;
+   unsigned int random = 1;
+   for (const size_t numX : widths)
+   {
+      const size_t rowBytes = numX * 3;
+      std::vector<unsigned char> image(numY * rowBytes), residuals(rowBytes);
+      const std::vector<unsigned char> zeros(rowBytes, 0);
+      for (size_t y = 0; y < numY; y++)
+      {
+         for (auto &residual : residuals)
+         {
+            random = random * 1103515245 + 12345;
+            residual = static_cast<unsigned char>((random >> 16) % 7 - 3);
+         }
+         UnfilterScanline(static_cast<int>(y % 5), residuals.data(),
+            y > 0 ? &image[(y - 1) * rowBytes] : zeros.data(), rowBytes, 3, &image[y * rowBytes]);
+      }
+      images.push_back(image);
+   }
+
+   Draw2pdf writer;
+   writer.EnableImageCompression(true);
+   PDFMemorySink sink;
+   writer.Open(sink, PDFPoint(0., 0.), PDFPoint(pageWidth, pageHeight));
+   for (size_t index = 0; index < images.size(); index++)
+   {
+      // Draw each image as 24 bits with padding at the end of each
+      // scanline, and as 32 bits.
+      const size_t numX = widths[index];
+      std::vector<unsigned char> padded(numY * (numX * 3 + 5)), withAlpha(numY * numX * 4, 0xFF);
+      for (size_t y = 0; y < numY; y++)
+      {
+         for (size_t x = 0; x < numX * 3; x++)
+         {
+            padded[y * (numX * 3 + 5) + x] = images[index][y * numX * 3 + x];
+            withAlpha[(y * numX + x / 3) * 4 + x % 3] = images[index][y * numX * 3 + x];
+         }
+      }
+      writer.DrawImage(padded.data(), numX, numY, 24, numX * 3 + 5, 100., 100., 100., 100.);
+      writer.DrawImage(withAlpha.data(), numX, numY, 32, numX * 4, 300., 100., 100., 100.);
+   }
+   writer.Close();
+
+   const std::string pdf(sink.GetData().begin(), sink.GetData().end());
+   bool filterUsed[5] = { false };
+   size_t offset = 0;
+   for (size_t index = 0; index < 2 * images.size(); index++)
+   {
+      const size_t numX = widths[index / 2];
+      const size_t rowBytes = numX * 3;
+      std::string dictionary, data, inflated;
+      offset = pdf.find("/Subtype /Image", offset);
+      if (offset == std::string::npos || !GetStream(pdf, offset, dictionary, data) ||
+          dictionary.find("/Predictor 15 /Colors 3 /BitsPerComponent 8 /Columns " +
+                          std::to_string(numX)) == std::string::npos ||
+          !InflateStream(data, numY * (1 + rowBytes), inflated))
+      {
+         wprintf(L"Image %zu compressed with predictors is wrong.\n", index);
+         return false;
+      }
+      offset += dictionary.size();
+
+      std::vector<unsigned char> pixels(numY * rowBytes);
+      const std::vector<unsigned char> zeros(rowBytes, 0);
+      for (size_t y = 0; y < numY; y++)
+      {
+         const unsigned char *filtered = reinterpret_cast<const unsigned char *>(inflated.data()) + y * (1 + rowBytes);
+         if (filtered[0] > 4)
+         {
+            wprintf(L"Image %zu has an unknown PNG filter type.\n", index);
+            return false;
+         }
+         filterUsed[filtered[0]] = true;
+         UnfilterScanline(filtered[0], filtered + 1, y > 0 ? &pixels[(y - 1) * rowBytes] : zeros.data(),
+                          rowBytes, 3, &pixels[y * rowBytes]);
+      }
+      if (pixels != images[index / 2])
+      {
+         wprintf(L"Image %zu compressed with predictors doesn't match its pixels.\n", index);
+         return false;
+      }
+   }
+   for (int filter = 0; filter < 5; filter++)
+   {
+      if (!filterUsed[filter])
+      {
+         wprintf(L"PNG filter type %d was never used.\n", filter);
+         return false;
+      }
+   }
+   return true;
+}
+
+bool TestCrossRefStream()
+{
+   // Write the test pages with a cross reference stream instead of
+   // a cross reference table, plus a page with a big uncompressed
+   // image so that the offsets need more than two bytes.  Each
+   // entry of the stream must point at its object, and the last
+   // entry at the stream itself.
+
+   Draw2pdf writer;
+   writer.EnableCrossRefStream(true);
+   PDFMemorySink sink;
+   writer.Open(sink, PDFPoint(0., 0.), PDFPoint(pageWidth, pageHeight));
+   DrawTestPages(writer);
+   writer.NextPage();
+   const std::string pixels(300 * 300, '\x80');
+   writer.DrawImage(pixels.data(), 300, 300, 8, 300, 100., 100., 300., 300.);
+   writer.Close();
+   const std::string pdf(sink.GetData().begin(), sink.GetData().end());
+
+   // The "startxref" keyword gives the offset of the stream object.
+   const size_t startxref = pdf.rfind("startxref\r\n");
+   if (startxref == std::string::npos || pdf.find("/Version /1.5") == std::string::npos)
+   {
+      wprintf(L"PDF file with cross reference stream is wrong.\n");
+      return false;
+   }
+   const size_t xrefOffset = strtoul(pdf.c_str() + startxref + 11, nullptr, 10);
+   std::string dictionary, data, entries;
+   if (!GetStream(pdf, xrefOffset, dictionary, data) ||
+       dictionary.find("/Type /XRef") == std::string::npos ||
+       dictionary.find("/Size ") == std::string::npos ||
+       dictionary.find("/W [ 1 ") == std::string::npos)
+   {
+      wprintf(L"Cross reference stream object is wrong.\n");
+      return false;
+   }
+
+   // Each entry is a type byte, the offset in as few bytes as the
+   // biggest offset needs, and a two-byte generation number.
+   const size_t numEntries = strtoul(dictionary.c_str() + dictionary.find("/Size ") + 6, nullptr, 10);
+   const size_t offsetWidth = strtoul(dictionary.c_str() + dictionary.find("/W [ 1 ") + 7, nullptr, 10);
+   const size_t entrySize = 1 + offsetWidth + 2;
+   if (offsetWidth != 3 || !InflateStream(data, numEntries * entrySize, entries))
+   {
+      wprintf(L"Cross reference stream data is wrong.\n");
+      return false;
+   }
+
+   // The first entry is the free entry at the head of the free list.
+   if (entries.compare(0, entrySize, std::string(entrySize - 2, '\0') + "\xFF\xFF") != 0)
+   {
+      wprintf(L"Cross reference stream's free entry is wrong.\n");
+      return false;
+   }
+   for (size_t objNum = 1; objNum < numEntries; objNum++)
+   {
+      const unsigned char *entry = reinterpret_cast<const unsigned char *>(entries.data()) + objNum * entrySize;
+      size_t offset = 0;
+      for (size_t byte = 0; byte < offsetWidth; byte++)
+         offset = (offset << 8) | entry[1 + byte];
+      const std::string objectStart = std::to_string(objNum) + " 0 obj";
+      if (entry[0] != 1 || entry[entrySize - 2] != 0 || entry[entrySize - 1] != 0 ||
+          offset >= pdf.size() || pdf.compare(offset, objectStart.size(), objectStart) != 0 ||
+          (objNum == numEntries - 1 && offset != xrefOffset))
+      {
+         wprintf(L"Cross reference stream's entry for object %zu is wrong.\n", objNum);
+         return false;
+      }
+   }
+   return true;
+}
+
 } // End anon namespace
 
 //--------------------------------------------------------------------
@@ -233,25 +625,16 @@ int main()
          PDFPoint(0., 0.),
          PDFPoint(pageWidth, pageHeight));
 
-      // Draw some test shapes on the first page.
-      DrawCornerMarks(writer);
-      TestDrawingLines(writer);
-      TestDrawingPolyline(writer);
-      TestDrawingPolygon(writer);
-      TestDrawingImage_8Bit(writer);
-      TestDrawingImage_24Bit(writer);
-      TestDrawingText(writer);
-      TestDrawingBigText(writer);
-
-      writer.NextPage();
-
-      // Draw some test shapes on the second page.
-      DrawCornerMarks(writer);
-      TestDrawingRectangles(writer);
-      TestDrawingPage2Text(writer);
+      DrawTestPages(writer);
 
       wprintf(L"Closing '%s'\n", outFilename);
       writer.Close();
+
+      // Check some of the other features.
+      wprintf(L"Checking other features\n");
+      if (!TestCancelledOutput() || !TestParallelCompression() || !TestCrossRefStream() ||
+          !TestSplitPointTypes() || !TestImagePredictors())
+         return EXIT_FAILURE;
    }
    catch(const PDFException &exc)
    {